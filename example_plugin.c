@@ -0,0 +1,87 @@
+/*
+ * example_plugin.c
+ *
+ * GPLv2
+ *
+ * An example --work-plugin.  Each thread hashes its own buffer once
+ * per operation, the arg is the buffer size in KB (def: 256).
+ *
+ * make example_plugin.so
+ * schbench --work-plugin ./example_plugin.so:512
+ */
+#include <stdlib.h>
+#include "schbench.h"
+
+struct hash_thread {
+	unsigned char *buf;
+	unsigned long size;
+	unsigned long long hash;
+};
+
+static void *hash_init(const char *arg)
+{
+	unsigned long *kb = malloc(sizeof(*kb));
+
+	if (!kb)
+		abort();
+	*kb = arg ? strtoul(arg, NULL, 10) : 256;
+	if (*kb == 0)
+		*kb = 1;
+	return kb;
+}
+
+static void *hash_thread_init(void *plugin_data)
+{
+	struct hash_thread *ht = calloc(1, sizeof(*ht));
+	unsigned long i;
+
+	if (!ht)
+		abort();
+	ht->size = *(unsigned long *)plugin_data * 1024;
+	ht->buf = malloc(ht->size);
+	if (!ht->buf)
+		abort();
+	for (i = 0; i < ht->size; i++)
+		ht->buf[i] = i;
+	return ht;
+}
+
+/* fnv-1a over the buffer, feeding each pass into the next */
+static void hash_do_work(void *thread_data, unsigned long ops)
+{
+	struct hash_thread *ht = thread_data;
+	unsigned long long hash = ht->hash ? ht->hash : 14695981039346656037ULL;
+	unsigned long i;
+
+	while (ops--) {
+		for (i = 0; i < ht->size; i++) {
+			hash ^= ht->buf[i];
+			hash *= 1099511628211ULL;
+		}
+		ht->buf[hash % ht->size] ^= hash;
+	}
+	ht->hash = hash;
+}
+
+static void hash_thread_exit(void *thread_data)
+{
+	struct hash_thread *ht = thread_data;
+
+	free(ht->buf);
+	free(ht);
+}
+
+static void hash_exit(void *plugin_data)
+{
+	free(plugin_data);
+}
+
+struct schbench_plugin schbench_plugin = {
+	.version = SCHBENCH_PLUGIN_VERSION,
+	.name = "fnv hash",
+	.init = hash_init,
+	.thread_init = hash_thread_init,
+	.do_work = hash_do_work,
+	.thread_exit = hash_thread_exit,
+	.exit = hash_exit,
+};
@@ -0,0 +1,16 @@
+/*
+ * main.c
+ *
+ * Copyright (C) 2016 Facebook
+ * Chris Mason <clm@fb.com>
+ *
+ * GPLv2
+ *
+ * The schbench command line tool, all the work happens in libschbench
+ */
+#include "schbench.h"
+
+int main(int ac, char **av)
+{
+	return schbench_main(ac, av);
+}
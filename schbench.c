@@ -6,7 +6,7 @@
  *
  * GPLv2, portions copied from the kernel and from Jens Axboe's fio
  *
- * gcc -Wall -O0 -W schbench.c -o schbench -lpthread
+ * gcc -Wall -O0 -W schbench.c main.c -o schbench -lpthread -lm -ldl
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,18 +22,54 @@
 #include <linux/futex.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+/* --trace, USDT probes when systemtap's sdt.h is around */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
 
-#define PLAT_BITS	8
-#define PLAT_VAL	(1 << PLAT_BITS)
-#define PLAT_GROUP_NR	19
-#define PLAT_NR		(PLAT_GROUP_NR * PLAT_VAL)
-#define PLAT_LIST_MAX	20
+#include "schbench.h"
 
 /* when -p is on, how much do we send back and forth */
 #define PIPE_TRANSFER_BUFFER (1 * 1024 * 1024)
 
 #define USEC_PER_SEC (1000000)
 
+/* --pipeline, stage 0 is always the regular worker pool */
+#define MAX_STAGES 16
+
+/* --request-template, max number of compute and sleep phases */
+#define MAX_REQUEST_PHASES 32
+
+/* --schedule, max number of load phases */
+#define MAX_LOAD_PHASES 64
+
+/* --class, max number of request classes */
+#define MAX_CLASSES 8
+
+/* --cpuidle-stats, max idle states per cpu we track */
+#define MAX_CSTATES 16
+
+/* --perf-counters, the number of entries in perf_counter_defs */
+#define NR_PERF_COUNTERS 8
+
+#ifndef SCHBENCH_VERSION
+#define SCHBENCH_VERSION ""
+#endif
+
 /* -m number of message threads */
 static int message_threads = 1;
 /* -t  number of workers per message thread */
@@ -46,6 +82,106 @@ static int warmuptime = 0;
 static int intervaltime = 10;
 /* -z  seconds */
 static int zerotime = 0;
+/* --tick-ms, how often we sample RPS and latencies */
+static int tick_ms = 1000;
+/* --timeseries, where to dump the per tick samples at exit */
+static char *timeseries_file = NULL;
+/* --timeseries-len, number of ticks the ring buffer holds */
+static int timeseries_len = 16384;
+/* --trace, where to write the per request trace at exit */
+static char *trace_file = NULL;
+/* --trace-entries, size of each thread's trace ring */
+static unsigned long trace_entries = 65536;
+/* --trace-marker bool, also write each trace event into ftrace */
+static int trace_marker = 0;
+static int trace_marker_fd = -1;
+/* every request we trace gets a unique id */
+static unsigned long long trace_request_ids = 0;
+/* --perf-counters bool, per worker perf_event_open counter groups */
+static int perf_counters = 0;
+/* --cpuidle-stats bool, sample cpuidle and cpufreq sysfs every interval */
+static int cpuidle_stats = 0;
+/* --cpu-dma-latency usecs, -1 leaves /dev/cpu_dma_latency alone */
+static int cpu_dma_latency = -1;
+/* --seed, everything random is derived from this */
+static unsigned long long seed = 0;
+static int seed_set = 0;
+/* --repeat, run the whole workload this many times */
+static int repeat_runs = 1;
+/* --repeat-cooldown, seconds of idle between repeated runs */
+static int repeat_cooldown = 5;
+/* --baseline, compare against results saved by --save-baseline */
+static char *baseline_file = NULL;
+static char *save_baseline_file = NULL;
+/* --alpha, significance level for the baseline comparison */
+static double regress_alpha = 0.05;
+/* --regress-pct, smallest change worth failing on */
+static double regress_pct = 5.0;
+/* --layout, how message groups are placed on the cpu topology */
+enum {
+	LAYOUT_NONE,
+	LAYOUT_LLC,
+	LAYOUT_CORE,
+	LAYOUT_PCORE,
+};
+static char *layout_names[] = { "none", "llc", "core", "pcore", NULL };
+static int layout = LAYOUT_NONE;
+/* --llc-stats, break wakeup and request latencies down per LLC */
+static int llc_stats = 0;
+/* did -m come from the user, or is it our default */
+static int message_threads_set = 0;
+/* --churn-pct, percent of each group's workers replaced every interval */
+static int churn_pct = 0;
+/* --churn-ramp, seconds per cycle of ramping workers down and back up */
+static int churn_ramp = 0;
+/* --churn-interval, msecs between churn events */
+static int churn_interval = 1000;
+/* how many wakeups after a worker starts count as young */
+#define CHURN_YOUNG_WAKEUPS 10
+/* --cpu-stats, per cpu usage, irqs and softirqs every interval */
+static int cpu_stats = 0;
+/* --energy, RAPL energy and requests per joule every interval */
+static int energy_stats = 0;
+/* --auto-rps-exclude, -A only counts our own cpu time as busy */
+static int auto_rps_exclude = 0;
+/* --mem-mode, what a request template memory phase does with its pages */
+enum {
+	MEM_MUNMAP,
+	MEM_DONTNEED,
+	MEM_THP,
+};
+static int mem_mode = MEM_MUNMAP;
+/* does the request template have any memory phases */
+static int nr_mem_phases = 0;
+static char *mem_mode_names[] = { "munmap", "dontneed", "thp", NULL };
+/* --buffer-mem, what backs the thread_data array and the matrices */
+enum {
+	BUFFER_MALLOC,
+	BUFFER_HUGETLB,
+	BUFFER_THP,
+	BUFFER_MLOCK,
+};
+static int buffer_mem = BUFFER_MALLOC;
+static char *buffer_mem_names[] = { "malloc", "hugetlb", "thp", "mlock", NULL };
+/* --wake-pattern, which group's workers a message thread posts to */
+enum {
+	WAKE_LOCAL,
+	WAKE_RANDOM,
+	WAKE_RING,
+	WAKE_REMOTE_LLC,
+	WAKE_REMOTE_NODE,
+};
+static int wake_pattern = WAKE_LOCAL;
+static char *wake_pattern_names[] = { "local", "random", "ring", "remote-llc",
+				      "remote-node", NULL };
+/* --manifest, where to record how this run was set up */
+static char *manifest_file = NULL;
+/* -R as given, before we split it between the message threads */
+static int requested_rps = 0;
+/* the original --pipeline and --request-template strings */
+static char *pipeline_spec = NULL;
+static char *request_template_spec = NULL;
+
 /* -f  cache_footprint_kb */
 static unsigned long cache_footprint_kb = 256;
 /* -n  operations */
@@ -61,6 +197,80 @@ static int requests_per_sec = 0;
 static int calibrate_only = 0;
 /* -L bool no locking during CPU work */
 static int skip_locking = 0;
+/* --steal bool idle workers steal requests from their siblings */
+static int work_steal = 0;
+/* --spin usecs to spin in fwait() before going to sleep */
+static unsigned int spin_usec = 0;
+/* --spin-adaptive bool, derive the spin budget from recent waits */
+static int spin_adaptive = 0;
+
+/*
+ * --pipeline, each stage is a pool of workers per message thread.
+ * Stage 0 is the regular worker pool, sized by -t and -n.  Requests
+ * finishing a stage are handed to a worker in the next one.
+ */
+struct stage_config {
+	int threads;
+	unsigned long operations;
+	unsigned long sleep_usec;
+};
+static struct stage_config stages[MAX_STAGES];
+static int nr_stages = 1;
+/* --fanout, subtasks each request scatters to sibling workers */
+static int fanout = 0;
+/* --fanout-random bool, pick between 1 and --fanout subtasks per request */
+static int fanout_random = 0;
+
+/*
+ * --request-template, replaces the usleep(100) + matrix math request
+ * with a list of compute and sleep phases
+ */
+enum {
+	PHASE_COMPUTE,
+	PHASE_SLEEP,
+	PHASE_SLEEP_UNIFORM,
+	PHASE_SLEEP_EXP,
+	PHASE_MEMORY,
+};
+
+struct request_phase {
+	int type;
+	/* operations for compute, usecs (or the low bound, or mean) for sleeps */
+	unsigned long a;
+	/* high bound for uniform sleeps */
+	unsigned long b;
+};
+static struct request_phase request_phases[MAX_REQUEST_PHASES];
+static int nr_request_phases = 0;
+
+/* --sleep-type, how the simulated network/disk waits sleep */
+enum {
+	SLEEP_USLEEP,
+	SLEEP_NANOSLEEP,
+	SLEEP_ABSTIME,
+	SLEEP_TIMERFD,
+	SLEEP_EPOLL,
+};
+static int sleep_type = SLEEP_USLEEP;
+static char *sleep_type_names[] = { "usleep", "nanosleep", "abstime",
+				    "timerfd", "epoll", NULL };
+
+/*
+ * --schedule, the run as a list of phases.  Each one has a duration,
+ * an rps target that can ramp from start to end, and optionally its
+ * own operations count (0 means use -n)
+ */
+struct load_phase {
+	unsigned long long duration_usec;
+	int rps_start;
+	int rps_end;
+	unsigned long operations;
+};
+static struct load_phase load_phases[MAX_LOAD_PHASES];
+static int nr_load_phases = 0;
+static char *schedule_spec = NULL;
+/* -n, before any phase changed it */
+static unsigned long base_operations;
 
 /* the message threads flip this to true when they decide runtime is up */
 static volatile unsigned long stopping = 0;
@@ -76,19 +286,153 @@ static struct per_cpu_lock *per_cpu_locks;
 static int num_cpu_locks;
 
 /*
- * one stat struct per thread data, when the workers sleep this records the
- * latency between when they are woken up and when they actually get the
- * CPU again.  The message threads sum up the stats of all the workers and
- * then bubble them up to main() for printing
+ * --lock, shared locks every request takes for part of its work, like
+ * a cache or a connection pool would.  release_usec is stamped by
+ * whoever unlocks, readers included, so the next owner can work out
+ * the handoff latency
+ */
+enum {
+	SHARED_LOCK_NONE,
+	SHARED_LOCK_FUTEX,
+	SHARED_LOCK_PI,
+	SHARED_LOCK_RWLOCK,
+};
+struct shared_lock {
+	int futex;
+	pthread_mutex_t mutex;
+	pthread_rwlock_t rwlock;
+	unsigned long long release_usec;
+} __attribute__((aligned));
+
+static int shared_lock_type = SHARED_LOCK_NONE;
+static char *shared_lock_names[] = { "none", "futex", "pi", "rwlock", NULL };
+/* --lock-count, how many locks requests spread over */
+static int shared_lock_count = 1;
+/* --lock-pct, how much of each request's work is done under the lock */
+static int shared_lock_pct = 10;
+/* --lock-read-pct, how many rwlock acquisitions are for reading */
+static int shared_lock_read_pct = 80;
+static struct shared_lock *shared_locks;
+
+/* --work-plugin, the plugin we loaded and what its init gave us */
+static char *work_plugin_spec = NULL;
+static const struct schbench_plugin *work_plugin = NULL;
+static void *work_plugin_data = NULL;
+static void *work_plugin_handle = NULL;
+
+/*
+ * libschbench, snapshots read the totals while a run is going.  This
+ * serializes them against the stats flips and resets.  run_live says
+ * all_threads is there to look at
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int run_live = 0;
+/* set by schbench_stop() to end the run before its runtime is up */
+static volatile int stop_requested = 0;
+
+/*
+ * schbench_create() points this at its jmp_buf while it parses the
+ * options and sets up, so a bad option sends it back there instead of
+ * taking the whole process down
+ */
+static jmp_buf *setup_jmp = NULL;
+
+static void __attribute__((noreturn)) setup_fail(void)
+{
+	if (setup_jmp)
+		longjmp(*setup_jmp, 1);
+	exit(1);
+}
+
+static struct stats rps_stats;
+
+/*
+ * --class and --periodic, a scheduling policy or nice level for a set of
+ * threads.  policy is a SCHED_* value, or -1 to leave it alone
+ */
+struct sched_policy {
+	int policy;
+	int rt_prio;
+	int nice;
+	int set_nice;
+};
+
+/*
+ * --class, requests of different priorities sharing the box.  Each
+ * class owns a slice of every message thread's workers, and has its
+ * own arrival rate, work size and scheduling policy or nice level
+ */
+struct request_class {
+	char name[32];
+	int workers;
+	int rps;
+	unsigned long operations;
+	struct sched_policy sched;
+	/* first worker of this class in each group */
+	int offset;
+	/* per tick rps, and the loop count at the last tick */
+	struct stats rps_stats;
+	unsigned long long last_loops;
+};
+static struct request_class classes[MAX_CLASSES];
+static int nr_classes = 0;
+
+/*
+ * --periodic, cyclictest style threads that wake on an absolute period
+ * next to the normal load.  Each one records how late it woke up
  */
-struct stats {
-	unsigned int plat[PLAT_NR];
-	unsigned long nr_samples;
-	unsigned int max;
-	unsigned int min;
+struct periodic_thread {
+	pthread_t tid;
+	int timer_fd;
+	unsigned long long missed;
+	struct stats jitter_stats;
+	/* the stats_reset_gen our stats belong to */
+	unsigned long reset_gen;
+};
+enum {
+	PERIODIC_NANOSLEEP,
+	PERIODIC_TIMERFD,
 };
+static int periodic_threads = 0;
+static unsigned long periodic_period = 0;
+static struct sched_policy periodic_sched = { .policy = -1 };
+static int periodic_timer = PERIODIC_NANOSLEEP;
+static char *periodic_timer_names[] = { "nanosleep", "timerfd", NULL };
+static struct periodic_thread *periodic_mem = NULL;
+
+/* --fibers, user level threads multiplexed onto each worker */
+static int fibers = 0;
+#define FIBER_STACK_SIZE (64 * 1024)
+
+/*
+ * worker wakeup and request latencies are double buffered.  Workers
+ * record into the buffer picked by stats_epoch, and the reporting
+ * thread flips the epoch, waits for anyone still writing the old
+ * buffer, and then folds the quiescent buffer into these totals.
+ * Zeroing only ever touches the totals or quiescent buffers, so no
+ * samples are torn or lost across intervals.
+ */
+static volatile unsigned long stats_epoch = 0;
+static struct stats total_wakeup_stats;
+static struct stats total_request_stats;
+
+/*
+ * what schbench_snapshot() flipped out from under the reporter.  The
+ * reporter folds these into its next tick so --timeseries and
+ * --schedule still see every sample
+ */
+static struct stats snap_wakeup_stats;
+static struct stats snap_request_stats;
 
-struct stats rps_stats;
+/*
+ * every other per thread histogram is only written by its own thread.
+ * Resetting them bumps stats_reset_gen, and each thread clears its own
+ * copies the next time it records something (stats_reset_check()).
+ * Threads that never record again are settled after they're joined
+ */
+static volatile unsigned long stats_reset_gen = 0;
+/* when the stats were last reset, or the run started */
+static struct timeval stats_reset_time;
 
 /* this defines which latency profiles get printed */
 #define PLIST_20 (1 << 0)
@@ -105,9 +449,56 @@ static double plist[PLAT_LIST_MAX] = { 20.0, 50.0, 90.0, 99.0, 99.9 };
 
 enum {
 	HELP_LONG_OPT = 1,
+	STEAL_LONG_OPT,
+	SPIN_LONG_OPT,
+	SPIN_ADAPTIVE_LONG_OPT,
+	PIPELINE_LONG_OPT,
+	FANOUT_LONG_OPT,
+	FANOUT_RANDOM_LONG_OPT,
+	REQUEST_TEMPLATE_LONG_OPT,
+	SCHEDULE_LONG_OPT,
+	CPU_STATS_LONG_OPT,
+	AUTO_RPS_EXCLUDE_LONG_OPT,
+	MEM_MODE_LONG_OPT,
+	BUFFER_MEM_LONG_OPT,
+	WAKE_PATTERN_LONG_OPT,
+	CLASS_LONG_OPT,
+	PERIODIC_LONG_OPT,
+	PERIODIC_TIMER_LONG_OPT,
+	FIBERS_LONG_OPT,
+	LOCK_LONG_OPT,
+	LOCK_COUNT_LONG_OPT,
+	LOCK_PCT_LONG_OPT,
+	LOCK_READ_PCT_LONG_OPT,
+	ENERGY_LONG_OPT,
+	WORK_PLUGIN_LONG_OPT,
+	SLEEP_TYPE_LONG_OPT,
+	TICK_MS_LONG_OPT,
+	TIMESERIES_LONG_OPT,
+	TIMESERIES_LEN_LONG_OPT,
+	TRACE_LONG_OPT,
+	TRACE_ENTRIES_LONG_OPT,
+	TRACE_MARKER_LONG_OPT,
+	PERF_COUNTERS_LONG_OPT,
+	CPUIDLE_STATS_LONG_OPT,
+	CPU_DMA_LATENCY_LONG_OPT,
+	CONFIG_LONG_OPT,
+	SEED_LONG_OPT,
+	MANIFEST_LONG_OPT,
+	REPEAT_LONG_OPT,
+	REPEAT_COOLDOWN_LONG_OPT,
+	BASELINE_LONG_OPT,
+	SAVE_BASELINE_LONG_OPT,
+	ALPHA_LONG_OPT,
+	REGRESS_PCT_LONG_OPT,
+	LAYOUT_LONG_OPT,
+	LLC_STATS_LONG_OPT,
+	CHURN_PCT_LONG_OPT,
+	CHURN_RAMP_LONG_OPT,
+	CHURN_INTERVAL_LONG_OPT,
 };
 
-char *option_string = "p:m:t:Cr:R:w:i:z:A:n:F:L";
+static char *option_string = "p:m:t:Cr:R:w:i:z:A:n:F:L";
 static struct option long_options[] = {
 	{"pipe", required_argument, 0, 'p'},
 	{"message-threads", required_argument, 0, 'm'},
@@ -122,6 +513,53 @@ static struct option long_options[] = {
 	{"warmuptime", required_argument, 0, 'w'},
 	{"intervaltime", required_argument, 0, 'i'},
 	{"zerotime", required_argument, 0, 'z'},
+	{"steal", no_argument, 0, STEAL_LONG_OPT},
+	{"spin", required_argument, 0, SPIN_LONG_OPT},
+	{"spin-adaptive", no_argument, 0, SPIN_ADAPTIVE_LONG_OPT},
+	{"pipeline", required_argument, 0, PIPELINE_LONG_OPT},
+	{"fanout", required_argument, 0, FANOUT_LONG_OPT},
+	{"fanout-random", no_argument, 0, FANOUT_RANDOM_LONG_OPT},
+	{"request-template", required_argument, 0, REQUEST_TEMPLATE_LONG_OPT},
+	{"schedule", required_argument, 0, SCHEDULE_LONG_OPT},
+	{"cpu-stats", no_argument, 0, CPU_STATS_LONG_OPT},
+	{"energy", no_argument, 0, ENERGY_LONG_OPT},
+	{"work-plugin", required_argument, 0, WORK_PLUGIN_LONG_OPT},
+	{"auto-rps-exclude", no_argument, 0, AUTO_RPS_EXCLUDE_LONG_OPT},
+	{"mem-mode", required_argument, 0, MEM_MODE_LONG_OPT},
+	{"buffer-mem", required_argument, 0, BUFFER_MEM_LONG_OPT},
+	{"wake-pattern", required_argument, 0, WAKE_PATTERN_LONG_OPT},
+	{"class", required_argument, 0, CLASS_LONG_OPT},
+	{"periodic", required_argument, 0, PERIODIC_LONG_OPT},
+	{"periodic-timer", required_argument, 0, PERIODIC_TIMER_LONG_OPT},
+	{"fibers", required_argument, 0, FIBERS_LONG_OPT},
+	{"lock", required_argument, 0, LOCK_LONG_OPT},
+	{"lock-count", required_argument, 0, LOCK_COUNT_LONG_OPT},
+	{"lock-pct", required_argument, 0, LOCK_PCT_LONG_OPT},
+	{"lock-read-pct", required_argument, 0, LOCK_READ_PCT_LONG_OPT},
+	{"sleep-type", required_argument, 0, SLEEP_TYPE_LONG_OPT},
+	{"tick-ms", required_argument, 0, TICK_MS_LONG_OPT},
+	{"timeseries", required_argument, 0, TIMESERIES_LONG_OPT},
+	{"timeseries-len", required_argument, 0, TIMESERIES_LEN_LONG_OPT},
+	{"trace", required_argument, 0, TRACE_LONG_OPT},
+	{"trace-entries", required_argument, 0, TRACE_ENTRIES_LONG_OPT},
+	{"trace-marker", no_argument, 0, TRACE_MARKER_LONG_OPT},
+	{"perf-counters", no_argument, 0, PERF_COUNTERS_LONG_OPT},
+	{"cpuidle-stats", no_argument, 0, CPUIDLE_STATS_LONG_OPT},
+	{"cpu-dma-latency", required_argument, 0, CPU_DMA_LATENCY_LONG_OPT},
+	{"config", required_argument, 0, CONFIG_LONG_OPT},
+	{"seed", required_argument, 0, SEED_LONG_OPT},
+	{"manifest", required_argument, 0, MANIFEST_LONG_OPT},
+	{"repeat", required_argument, 0, REPEAT_LONG_OPT},
+	{"repeat-cooldown", required_argument, 0, REPEAT_COOLDOWN_LONG_OPT},
+	{"baseline", required_argument, 0, BASELINE_LONG_OPT},
+	{"save-baseline", required_argument, 0, SAVE_BASELINE_LONG_OPT},
+	{"alpha", required_argument, 0, ALPHA_LONG_OPT},
+	{"regress-pct", required_argument, 0, REGRESS_PCT_LONG_OPT},
+	{"layout", required_argument, 0, LAYOUT_LONG_OPT},
+	{"llc-stats", no_argument, 0, LLC_STATS_LONG_OPT},
+	{"churn-pct", required_argument, 0, CHURN_PCT_LONG_OPT},
+	{"churn-ramp", required_argument, 0, CHURN_RAMP_LONG_OPT},
+	{"churn-interval", required_argument, 0, CHURN_INTERVAL_LONG_OPT},
 	{"help", no_argument, 0, HELP_LONG_OPT},
 	{0, 0, 0, 0}
 };
@@ -142,13 +580,629 @@ static void print_usage(void)
 		"\t-w (--warmuptime): how long to warmup before resetting stats (seconds, def: 0)\n"
 		"\t-i (--intervaltime): interval for printing latencies (seconds, def: 10)\n"
 		"\t-z (--zerotime): interval for zeroing latencies (seconds, def: never)\n"
+		"\t   (--steal): idle workers steal queued requests from siblings (needs -R or -A)\n"
+		"\t   (--spin): usecs to spin before sleeping on a futex (def: 0)\n"
+		"\t   (--spin-adaptive): scale the spin budget from recent waits (def: off)\n"
+		"\t   (--pipeline): extra stages after the workers, threads:ops[:usleep],... (def: none)\n"
+		"\t   (--fanout): subtasks each request scatters to sibling workers (def: 0)\n"
+		"\t   (--fanout-random): use between 1 and --fanout subtasks per request (def: off)\n"
+		"\t   (--request-template): compute, sleep and memory phases, cN,sN,sA-B,eN,mKB,... (def: s100,c<ops>)\n"
+		"\t   (--sleep-type): usleep, nanosleep, abstime, timerfd or epoll (def: usleep)\n"
+		"\t   (--tick-ms): how often to sample rps and latencies (msec, def: 1000)\n"
+		"\t   (--timeseries): dump per tick samples to this file at exit, - for stderr (def: none)\n"
+		"\t   (--timeseries-len): ticks kept in the time series ring buffer (def: 16384)\n"
+		"\t   (--trace): write a per request event trace to this file at exit (def: none)\n"
+		"\t   (--trace-entries): events kept per thread in the trace ring (def: 65536)\n"
+		"\t   (--trace-marker): also write trace events to the ftrace trace_marker (def: off)\n"
+		"\t   (--perf-counters): count cycles, instructions, cache misses per request (def: off)\n"
+		"\t   (--cpuidle-stats): report C-state entries, residency and cpu frequency (def: off)\n"
+		"\t   (--cpu-dma-latency): hold /dev/cpu_dma_latency at this many usecs (def: unset)\n"
+		"\t   (--config): read long options from a file, one per line (def: none)\n"
+		"\t   (--seed): seed for all randomized dispatch and work (def: time based)\n"
+		"\t   (--manifest): write the effective setup and system details at exit (def: none)\n"
+		"\t   (--repeat): run the workload this many times and report confidence intervals (def: 1)\n"
+		"\t   (--repeat-cooldown): seconds to idle between repeated runs (def: 5)\n"
+		"\t   (--save-baseline): save per run results to a file (def: none)\n"
+		"\t   (--baseline): compare against a saved baseline, exit 2 on regression (def: none)\n"
+		"\t   (--alpha): significance level for --baseline (def: 0.05)\n"
+		"\t   (--regress-pct): smallest median change --baseline fails on (def: 5)\n"
+		"\t   (--layout): pin message groups by topology: none|llc|core|pcore (def: none)\n"
+		"\t   (--llc-stats): show wakeup and request latencies per LLC (def: off)\n"
+		"\t   (--churn-pct): percent of workers to replace every churn interval (def: 0)\n"
+		"\t   (--churn-ramp): secs per cycle of ramping workers down to 1 and back (def: 0)\n"
+		"\t   (--churn-interval): msecs between churn events (def: 1000)\n"
+		"\t   (--schedule): load phases secs:rps[-rps][:ops],... (def: none)\n"
+		"\t   (--cpu-stats): per cpu busy, irq, softirq and steal every interval (def: off)\n"
+		"\t   (--energy): RAPL joules, watts and requests per joule every interval (def: off)\n"
+		"\t   (--work-plugin): shared object with the request work, file[:arg] (def: none)\n"
+		"\t   (--auto-rps-exclude): -A only counts schbench's own cpu time (def: off)\n"
+		"\t   (--mem-mode): memory phases use munmap|dontneed|thp (def: munmap)\n"
+		"\t   (--buffer-mem): back thread state and matrices with malloc|hugetlb|thp|mlock (def: malloc)\n"
+		"\t   (--wake-pattern): post rps requests local|random|ring|remote-llc|remote-node (def: local)\n"
+		"\t   (--class): request class name:workers:rps:ops[:policy], repeatable (def: none)\n"
+		"\t   (--periodic): periodic jitter threads threads:period_usec[:policy] (def: none)\n"
+		"\t   (--periodic-timer): periodic threads wait with nanosleep|timerfd (def: nanosleep)\n"
+		"\t   (--fibers): user level threads per worker, needs -R or -A (def: 0)\n"
+		"\t   (--lock): shared lock taken by each request none|futex|pi|rwlock (def: none)\n"
+		"\t   (--lock-count): number of shared locks requests pick from (def: 1)\n"
+		"\t   (--lock-pct): percent of each request's work done under the lock (def: 10)\n"
+		"\t   (--lock-read-pct): percent of rwlock acquisitions that are reads (def: 80)\n"
 	       );
-	exit(1);
+	setup_fail();
+}
+
+/*
+ * --pipeline threads:ops[:usleep],threads:ops[:usleep],...
+ * fills in stages[1] and up, stage 0 comes from -t and -n
+ */
+static void parse_pipeline(char *arg)
+{
+	char *save = NULL;
+	char *tok;
+
+	pipeline_spec = strdup(arg);
+	nr_stages = 1;
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		struct stage_config *stage;
+		int ret;
+
+		if (nr_stages == MAX_STAGES) {
+			fprintf(stderr, "too many pipeline stages, max is %d\n",
+				MAX_STAGES);
+			setup_fail();
+		}
+		stage = &stages[nr_stages];
+		stage->sleep_usec = 0;
+		ret = sscanf(tok, "%d:%lu:%lu", &stage->threads,
+			     &stage->operations, &stage->sleep_usec);
+		if (ret < 2 || stage->threads <= 0) {
+			fprintf(stderr, "invalid pipeline stage '%s'\n", tok);
+			setup_fail();
+		}
+		nr_stages++;
+	}
+}
+
+/*
+ * policy is one of other, nice=N, batch, idle, fifo=PRIO or rr=PRIO.
+ * Returns -1 if we don't understand it
+ */
+static int parse_sched_policy(char *str, struct sched_policy *sched)
+{
+	memset(sched, 0, sizeof(*sched));
+	sched->policy = -1;
+	if (sscanf(str, "nice=%d", &sched->nice) == 1)
+		sched->set_nice = 1;
+	else if (strcmp(str, "other") == 0)
+		sched->policy = SCHED_OTHER;
+	else if (strcmp(str, "batch") == 0)
+		sched->policy = SCHED_BATCH;
+	else if (strcmp(str, "idle") == 0)
+		sched->policy = SCHED_IDLE;
+	else if (sscanf(str, "fifo=%d", &sched->rt_prio) == 1)
+		sched->policy = SCHED_FIFO;
+	else if (sscanf(str, "rr=%d", &sched->rt_prio) == 1)
+		sched->policy = SCHED_RR;
+	else
+		return -1;
+	return 0;
+}
+
+/*
+ * --class name:workers:rps:ops[:policy], policy as in
+ * parse_sched_policy()
+ */
+static void parse_class(char *arg)
+{
+	struct request_class *class;
+	char policy[32] = "";
+	int ret;
+
+	if (nr_classes == MAX_CLASSES) {
+		fprintf(stderr, "too many request classes, max is %d\n",
+			MAX_CLASSES);
+		setup_fail();
+	}
+	class = &classes[nr_classes];
+	memset(class, 0, sizeof(*class));
+	class->sched.policy = -1;
+	ret = sscanf(arg, "%31[^:]:%d:%d:%lu:%31s", class->name,
+		     &class->workers, &class->rps, &class->operations, policy);
+	if (ret < 4 || class->workers <= 0 || class->rps <= 0)
+		goto invalid;
+
+	if (ret == 5 && parse_sched_policy(policy, &class->sched))
+		goto invalid;
+	nr_classes++;
+	return;
+invalid:
+	fprintf(stderr, "invalid request class '%s'\n", arg);
+	setup_fail();
+}
+
+/* --periodic threads:period_usec[:policy] */
+static void parse_periodic(char *arg)
+{
+	char policy[32] = "";
+	int ret;
+
+	ret = sscanf(arg, "%d:%lu:%31s", &periodic_threads, &periodic_period,
+		     policy);
+	if (ret < 2 || periodic_threads <= 0 || periodic_period == 0 ||
+	    (ret == 3 && parse_sched_policy(policy, &periodic_sched))) {
+		fprintf(stderr, "invalid periodic threads '%s'\n", arg);
+		setup_fail();
+	}
+}
+
+/*
+ * --schedule, comma separated phases of secs:rps[:ops].  rps can be
+ * A-B to ramp linearly over the phase.  A square wave is just
+ * alternating phases: 5:1000,5:8000,5:1000,5:8000
+ */
+static void parse_schedule(char *arg)
+{
+	char *save = NULL;
+	char *tok;
+
+	schedule_spec = strdup(arg);
+	nr_load_phases = 0;
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		struct load_phase *phase;
+		double secs;
+		char *rps;
+		char *c;
+
+		if (nr_load_phases == MAX_LOAD_PHASES) {
+			fprintf(stderr, "too many schedule phases, max is %d\n",
+				MAX_LOAD_PHASES);
+			setup_fail();
+		}
+		phase = &load_phases[nr_load_phases];
+		secs = strtod(tok, &rps);
+		if (*rps != ':' || secs <= 0)
+			goto invalid;
+		rps++;
+		phase->duration_usec = secs * USEC_PER_SEC;
+		phase->rps_start = strtol(rps, &c, 10);
+		phase->rps_end = phase->rps_start;
+		if (*c == '-')
+			phase->rps_end = strtol(c + 1, &c, 10);
+		phase->operations = 0;
+		if (*c == ':')
+			phase->operations = strtoul(c + 1, &c, 10);
+		if (*c || phase->rps_start <= 0 || phase->rps_end <= 0)
+			goto invalid;
+		nr_load_phases++;
+		continue;
+invalid:
+		fprintf(stderr, "invalid schedule phase '%s'\n", tok);
+		setup_fail();
+	}
+}
+
+/*
+ * --request-template, comma separated phases:
+ *   cN    N operations of matrix math
+ *   sN    sleep N usecs
+ *   sA-B  sleep a uniformly random number of usecs between A and B
+ *   eN    sleep an exponentially distributed number of usecs, mean N
+ *   mN    map, touch and drop N KB of memory, see --mem-mode
+ */
+static void parse_request_template(char *arg)
+{
+	char *save = NULL;
+	char *tok;
+
+	request_template_spec = strdup(arg);
+	nr_request_phases = 0;
+	nr_mem_phases = 0;
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		struct request_phase *phase;
+		int ret = 0;
+
+		if (nr_request_phases == MAX_REQUEST_PHASES) {
+			fprintf(stderr, "too many request phases, max is %d\n",
+				MAX_REQUEST_PHASES);
+			setup_fail();
+		}
+		phase = &request_phases[nr_request_phases];
+		switch (tok[0]) {
+		case 'c':
+			phase->type = PHASE_COMPUTE;
+			ret = sscanf(tok + 1, "%lu", &phase->a);
+			break;
+		case 's':
+			phase->type = PHASE_SLEEP;
+			ret = sscanf(tok + 1, "%lu-%lu", &phase->a, &phase->b);
+			if (ret == 2) {
+				if (phase->b < phase->a) {
+					fprintf(stderr, "invalid sleep range '%s'\n", tok);
+					setup_fail();
+				}
+				phase->type = PHASE_SLEEP_UNIFORM;
+			}
+			break;
+		case 'e':
+			phase->type = PHASE_SLEEP_EXP;
+			ret = sscanf(tok + 1, "%lu", &phase->a);
+			break;
+		case 'm':
+			phase->type = PHASE_MEMORY;
+			ret = sscanf(tok + 1, "%lu", &phase->a);
+			if (ret == 1 && phase->a == 0)
+				ret = 0;
+			nr_mem_phases++;
+			break;
+		}
+		if (ret < 1) {
+			fprintf(stderr, "invalid request phase '%s'\n", tok);
+			setup_fail();
+		}
+		nr_request_phases++;
+	}
+}
+
+static void parse_sleep_type(char *arg)
+{
+	int i;
+
+	for (i = 0; sleep_type_names[i]; i++) {
+		if (strcmp(arg, sleep_type_names[i]) == 0) {
+			sleep_type = i;
+			return;
+		}
+	}
+	fprintf(stderr, "unknown sleep type '%s'\n", arg);
+	setup_fail();
+}
+
+static void parse_config_file(char *path, int *found_warmuptime);
+
+/*
+ * apply one option, either from the command line or from a --config
+ * file.  found_warmuptime is for parse_options() to sort out after
+ * everything else is parsed
+ */
+static void handle_option(int c, char *arg, int *found_warmuptime)
+{
+	switch(c) {
+	case 'C':
+		calibrate_only = 1;
+		break;
+	case 'L':
+		skip_locking = 1;
+		break;
+	case 'A':
+		auto_rps = atoi(arg);
+		warmuptime = 0;
+		if (requests_per_sec == 0)
+			requests_per_sec = 10;
+		break;
+	case 'p':
+		pipe_test = atoi(arg);
+		if (pipe_test > PIPE_TRANSFER_BUFFER) {
+			fprintf(stderr, "pipe size too big, using %d\n",
+				PIPE_TRANSFER_BUFFER);
+			pipe_test = PIPE_TRANSFER_BUFFER;
+		}
+		warmuptime = 0;
+		break;
+	case 'w':
+		*found_warmuptime = atoi(arg);
+		break;
+	case 'm':
+		message_threads = atoi(arg);
+		message_threads_set = 1;
+		break;
+	case 't':
+		worker_threads = atoi(arg);
+		break;
+	case 'r':
+		runtime = atoi(arg);
+		break;
+	case 'i':
+		intervaltime = atoi(arg);
+		break;
+	case 'z':
+		zerotime = atoi(arg);
+		break;
+	case 'R':
+		requests_per_sec = atoi(arg);
+		break;
+	case 'n':
+		operations = atoi(arg);
+		break;
+	case 'f':
+	case 'F':
+		cache_footprint_kb = atoi(arg);
+		break;
+	case STEAL_LONG_OPT:
+		work_steal = 1;
+		break;
+	case SPIN_LONG_OPT:
+		spin_usec = atoi(arg);
+		break;
+	case SPIN_ADAPTIVE_LONG_OPT:
+		spin_adaptive = 1;
+		break;
+	case PIPELINE_LONG_OPT:
+		parse_pipeline(arg);
+		break;
+	case SCHEDULE_LONG_OPT:
+		parse_schedule(arg);
+		break;
+	case CPU_STATS_LONG_OPT:
+		cpu_stats = 1;
+		break;
+	case ENERGY_LONG_OPT:
+		energy_stats = 1;
+		break;
+	case WORK_PLUGIN_LONG_OPT:
+		work_plugin_spec = strdup(arg);
+		break;
+	case AUTO_RPS_EXCLUDE_LONG_OPT:
+		auto_rps_exclude = 1;
+		break;
+	case MEM_MODE_LONG_OPT:
+		for (mem_mode = 0; mem_mode_names[mem_mode]; mem_mode++) {
+			if (strcmp(arg, mem_mode_names[mem_mode]) == 0)
+				break;
+		}
+		if (!mem_mode_names[mem_mode]) {
+			fprintf(stderr, "unknown --mem-mode %s\n", arg);
+			setup_fail();
+		}
+		break;
+	case BUFFER_MEM_LONG_OPT:
+		for (buffer_mem = 0; buffer_mem_names[buffer_mem]; buffer_mem++) {
+			if (strcmp(arg, buffer_mem_names[buffer_mem]) == 0)
+				break;
+		}
+		if (!buffer_mem_names[buffer_mem]) {
+			fprintf(stderr, "unknown --buffer-mem %s\n", arg);
+			setup_fail();
+		}
+		break;
+	case CLASS_LONG_OPT:
+		parse_class(arg);
+		break;
+	case PERIODIC_LONG_OPT:
+		parse_periodic(arg);
+		break;
+	case FIBERS_LONG_OPT:
+		fibers = atoi(arg);
+		break;
+	case LOCK_LONG_OPT:
+		for (shared_lock_type = 0; shared_lock_names[shared_lock_type];
+		     shared_lock_type++) {
+			if (strcmp(arg, shared_lock_names[shared_lock_type]) == 0)
+				break;
+		}
+		if (!shared_lock_names[shared_lock_type]) {
+			fprintf(stderr, "unknown --lock %s\n", arg);
+			setup_fail();
+		}
+		break;
+	case LOCK_COUNT_LONG_OPT:
+		shared_lock_count = atoi(arg);
+		break;
+	case LOCK_PCT_LONG_OPT:
+		shared_lock_pct = atoi(arg);
+		break;
+	case LOCK_READ_PCT_LONG_OPT:
+		shared_lock_read_pct = atoi(arg);
+		break;
+	case PERIODIC_TIMER_LONG_OPT:
+		for (periodic_timer = 0; periodic_timer_names[periodic_timer];
+		     periodic_timer++) {
+			if (strcmp(arg, periodic_timer_names[periodic_timer]) == 0)
+				break;
+		}
+		if (!periodic_timer_names[periodic_timer]) {
+			fprintf(stderr, "unknown --periodic-timer %s\n", arg);
+			setup_fail();
+		}
+		break;
+	case WAKE_PATTERN_LONG_OPT:
+		for (wake_pattern = 0; wake_pattern_names[wake_pattern];
+		     wake_pattern++) {
+			if (strcmp(arg, wake_pattern_names[wake_pattern]) == 0)
+				break;
+		}
+		if (!wake_pattern_names[wake_pattern]) {
+			fprintf(stderr, "unknown --wake-pattern %s\n", arg);
+			setup_fail();
+		}
+		break;
+	case FANOUT_LONG_OPT:
+		fanout = atoi(arg);
+		break;
+	case FANOUT_RANDOM_LONG_OPT:
+		fanout_random = 1;
+		break;
+	case REQUEST_TEMPLATE_LONG_OPT:
+		parse_request_template(arg);
+		break;
+	case SLEEP_TYPE_LONG_OPT:
+		parse_sleep_type(arg);
+		break;
+	case TICK_MS_LONG_OPT:
+		tick_ms = atoi(arg);
+		break;
+	case TIMESERIES_LONG_OPT:
+		timeseries_file = arg;
+		break;
+	case TIMESERIES_LEN_LONG_OPT:
+		timeseries_len = atoi(arg);
+		break;
+	case TRACE_LONG_OPT:
+		trace_file = arg;
+		break;
+	case TRACE_ENTRIES_LONG_OPT:
+		trace_entries = atol(arg);
+		break;
+	case TRACE_MARKER_LONG_OPT:
+		trace_marker = 1;
+		break;
+	case PERF_COUNTERS_LONG_OPT:
+		perf_counters = 1;
+		break;
+	case CPUIDLE_STATS_LONG_OPT:
+		cpuidle_stats = 1;
+		break;
+	case CPU_DMA_LATENCY_LONG_OPT:
+		cpu_dma_latency = atoi(arg);
+		break;
+	case CONFIG_LONG_OPT:
+		parse_config_file(arg, found_warmuptime);
+		break;
+	case SEED_LONG_OPT:
+		seed = strtoull(arg, NULL, 0);
+		seed_set = 1;
+		break;
+	case MANIFEST_LONG_OPT:
+		manifest_file = arg;
+		break;
+	case REPEAT_LONG_OPT:
+		repeat_runs = atoi(arg);
+		if (repeat_runs < 1) {
+			fprintf(stderr, "--repeat must be at least 1\n");
+			setup_fail();
+		}
+		break;
+	case REPEAT_COOLDOWN_LONG_OPT:
+		repeat_cooldown = atoi(arg);
+		break;
+	case BASELINE_LONG_OPT:
+		baseline_file = arg;
+		break;
+	case SAVE_BASELINE_LONG_OPT:
+		save_baseline_file = arg;
+		break;
+	case ALPHA_LONG_OPT:
+		regress_alpha = atof(arg);
+		break;
+	case REGRESS_PCT_LONG_OPT:
+		regress_pct = atof(arg);
+		break;
+	case LAYOUT_LONG_OPT:
+		for (layout = 0; layout_names[layout]; layout++) {
+			if (strcmp(arg, layout_names[layout]) == 0)
+				break;
+		}
+		if (!layout_names[layout]) {
+			fprintf(stderr, "unknown --layout %s\n", arg);
+			setup_fail();
+		}
+		/* the whole point of a layout is comparing the LLCs */
+		if (layout != LAYOUT_NONE)
+			llc_stats = 1;
+		break;
+	case LLC_STATS_LONG_OPT:
+		llc_stats = 1;
+		break;
+	case CHURN_PCT_LONG_OPT:
+		churn_pct = atoi(arg);
+		break;
+	case CHURN_RAMP_LONG_OPT:
+		churn_ramp = atoi(arg);
+		break;
+	case CHURN_INTERVAL_LONG_OPT:
+		churn_interval = atoi(arg);
+		if (churn_interval < 1) {
+			fprintf(stderr, "--churn-interval must be at least 1\n");
+			setup_fail();
+		}
+		break;
+	case '?':
+	case HELP_LONG_OPT:
+		print_usage();
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * --config, one option per line using the long option names, with
+ * either "name value" or "name = value".  Everything after a '#' is
+ * a comment.  Options are applied in order, so anything on the command
+ * line after --config overrides the file
+ */
+static void parse_config_file(char *path, int *found_warmuptime)
+{
+	char line[1024];
+	FILE *fp;
+	int lineno = 0;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror("unable to open config file");
+		setup_fail();
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct option *opt;
+		char *name;
+		char *value = NULL;
+		char *c;
+
+		lineno++;
+		c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+
+		name = line + strspn(line, " \t\r\n");
+		if (*name == '\0')
+			continue;
+		c = name + strcspn(name, " \t\r\n=");
+		if (*c) {
+			*c++ = '\0';
+			value = c + strspn(c, " \t\r\n=");
+			c = value + strlen(value);
+			while (c > value && strchr(" \t\r\n", c[-1]))
+				*--c = '\0';
+			if (*value == '\0')
+				value = NULL;
+		}
+
+		for (opt = long_options; opt->name; opt++) {
+			if (strcmp(opt->name, name) == 0)
+				break;
+		}
+		if (!opt->name || opt->val == CONFIG_LONG_OPT) {
+			fprintf(stderr, "%s:%d: unknown option '%s'\n", path,
+				lineno, name);
+			fclose(fp);
+			setup_fail();
+		}
+		if (opt->has_arg == required_argument && !value) {
+			fprintf(stderr, "%s:%d: option '%s' needs a value\n", path,
+				lineno, name);
+			fclose(fp);
+			setup_fail();
+		}
+		/* some of our options hang on to their argument */
+		if (value) {
+			value = strdup(value);
+			if (!value) {
+				perror("strdup");
+				fclose(fp);
+				setup_fail();
+			}
+		}
+		handle_option(opt->val, value, found_warmuptime);
+	}
+	fclose(fp);
 }
 
 static void parse_options(int ac, char **av)
 {
 	int c;
+	int i;
 	int found_warmuptime = -1;
 
 	while (1) {
@@ -160,62 +1214,7 @@ static void parse_options(int ac, char **av)
 		if (c == -1)
 			break;
 
-		switch(c) {
-		case 'C':
-			calibrate_only = 1;
-			break;
-		case 'L':
-			skip_locking = 1;
-			break;
-		case 'A':
-			auto_rps = atoi(optarg);
-			warmuptime = 0;
-			if (requests_per_sec == 0)
-				requests_per_sec = 10;
-			break;
-		case 'p':
-			pipe_test = atoi(optarg);
-			if (pipe_test > PIPE_TRANSFER_BUFFER) {
-				fprintf(stderr, "pipe size too big, using %d\n",
-					PIPE_TRANSFER_BUFFER);
-				pipe_test = PIPE_TRANSFER_BUFFER;
-			}
-			warmuptime = 0;
-			break;
-		case 'w':
-			found_warmuptime = atoi(optarg);
-			break;
-		case 'm':
-			message_threads = atoi(optarg);
-			break;
-		case 't':
-			worker_threads = atoi(optarg);
-			break;
-		case 'r':
-			runtime = atoi(optarg);
-			break;
-		case 'i':
-			intervaltime = atoi(optarg);
-			break;
-		case 'z':
-			zerotime = atoi(optarg);
-			break;
-		case 'R':
-			requests_per_sec = atoi(optarg);
-			break;
-		case 'n':
-			operations = atoi(optarg);
-			break;
-		case 'F':
-			cache_footprint_kb = atoi(optarg);
-			break;
-		case '?':
-		case HELP_LONG_OPT:
-			print_usage();
-			break;
-		default:
-			break;
-		}
+		handle_option(c, optarg, &found_warmuptime);
 	}
 
 	/*
@@ -231,13 +1230,137 @@ static void parse_options(int ac, char **av)
 	if (runtime < 30)
 		warmuptime = 0;
 
+	if (tick_ms <= 0 || tick_ms > 1000) {
+		fprintf(stderr, "--tick-ms must be between 1 and 1000\n");
+		setup_fail();
+	}
+	if (timeseries_len <= 0) {
+		fprintf(stderr, "--timeseries-len must be positive\n");
+		setup_fail();
+	}
+
+	if (trace_marker && !trace_file) {
+		fprintf(stderr, "--trace-marker requires --trace\n");
+		setup_fail();
+	}
+	if (trace_entries == 0) {
+		fprintf(stderr, "--trace-entries must be positive\n");
+		setup_fail();
+	}
+
+	if (nr_load_phases) {
+		unsigned long long total = 0;
+
+		if (auto_rps) {
+			fprintf(stderr, "--schedule can't be used with -A\n");
+			setup_fail();
+		}
+		if (pipe_test) {
+			fprintf(stderr, "--schedule can't be used with -p\n");
+			setup_fail();
+		}
+		for (i = 0; i < nr_load_phases; i++)
+			total += load_phases[i].duration_usec;
+		/* the schedule decides how long we run, and puts us in rps mode */
+		runtime = (total + USEC_PER_SEC - 1) / USEC_PER_SEC;
+		requests_per_sec = load_phases[0].rps_start;
+		base_operations = operations;
+	}
+
+	if (churn_ramp && fanout) {
+		fprintf(stderr, "--churn-ramp can't be used with --fanout\n");
+		setup_fail();
+	}
+
+	if (periodic_threads && pipe_test) {
+		fprintf(stderr, "--periodic can't be used with -p\n");
+		setup_fail();
+	}
+
+	/* classes bring their own worker counts and rates */
+	if (nr_classes) {
+		int offset = 0;
+
+		if (auto_rps || nr_load_phases || pipe_test || churn_ramp) {
+			fprintf(stderr, "--class can't be used with -A, -p, "
+				"--schedule or --churn-ramp\n");
+			setup_fail();
+		}
+		requests_per_sec = 0;
+		for (i = 0; i < nr_classes; i++) {
+			classes[i].offset = offset;
+			offset += classes[i].workers;
+			requests_per_sec += classes[i].rps;
+		}
+		worker_threads = offset;
+	}
+
+	if (spin_adaptive && !spin_usec) {
+		fprintf(stderr, "--spin-adaptive requires --spin\n");
+		setup_fail();
+	}
+
+	if (nr_stages > 1 && pipe_test) {
+		fprintf(stderr, "--pipeline can't be used with pipe mode\n");
+		setup_fail();
+	}
+
+	if (fanout && pipe_test) {
+		fprintf(stderr, "--fanout can't be used with pipe mode\n");
+		setup_fail();
+	}
+	if (fanout_random && !fanout) {
+		fprintf(stderr, "--fanout-random requires --fanout\n");
+		setup_fail();
+	}
+
+	/* only the rps modes queue requests that can be stolen */
+	if (work_steal && !requests_per_sec) {
+		fprintf(stderr, "--steal requires -R or -A\n");
+		setup_fail();
+	}
+
+	if (wake_pattern != WAKE_LOCAL && !requests_per_sec) {
+		fprintf(stderr, "--wake-pattern requires -R or -A\n");
+		setup_fail();
+	}
+
+	if (shared_lock_count < 1 || shared_lock_pct < 0 ||
+	    shared_lock_pct > 100 || shared_lock_read_pct < 0 ||
+	    shared_lock_read_pct > 100) {
+		fprintf(stderr, "--lock-count must be at least 1, --lock-pct "
+			"and --lock-read-pct must be 0-100\n");
+		setup_fail();
+	}
+
+	/* fibers only know how to run the default request */
+	if (fibers) {
+		if (!requests_per_sec) {
+			fprintf(stderr, "--fibers requires -R or -A\n");
+			setup_fail();
+		}
+		if (fanout || nr_stages > 1 || nr_request_phases || work_steal ||
+		    churn_pct || churn_ramp) {
+			fprintf(stderr, "--fibers can't be used with --fanout, "
+				"--pipeline, --request-template, --steal or churn\n");
+			setup_fail();
+		}
+	}
+
 	if (optind < ac) {
 		fprintf(stderr, "Error Extra arguments '%s'\n", av[optind]);
-		exit(1);
+		setup_fail();
+	}
+
+	if (!seed_set) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		seed = now.tv_sec * USEC_PER_SEC + now.tv_usec;
 	}
 }
 
-void tvsub(struct timeval * tdiff, struct timeval * t1, struct timeval * t0)
+static void tvsub(struct timeval * tdiff, struct timeval * t1, struct timeval * t0)
 {
 	tdiff->tv_sec = t1->tv_sec - t0->tv_sec;
 	tdiff->tv_usec = t1->tv_usec - t0->tv_usec;
@@ -261,7 +1384,7 @@ void tvsub(struct timeval * tdiff, struct timeval * t1, struct timeval * t0)
  * returns the difference between start and stop in usecs.  Negative values
  * are turned into 0
  */
-unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
+static unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
 {
 	struct timeval td;
 	unsigned long long usecs;
@@ -388,6 +1511,25 @@ static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
 	return len;
 }
 
+/* the value at a single percentile, cheaper than calc_percentiles */
+static unsigned int stats_percentile(struct stats *s, double pct)
+{
+	unsigned long long target;
+	unsigned long long sum = 0;
+	int i;
+
+	if (s->nr_samples == 0)
+		return 0;
+
+	target = ceil(pct / 100.0 * s->nr_samples);
+	for (i = 0; i < PLAT_NR; i++) {
+		sum += s->plat[i];
+		if (sum >= target)
+			return plat_idx_to_val(i);
+	}
+	return s->max;
+}
+
 static void show_latencies(struct stats *s, char *label, char *units,
 			   unsigned long long runtime, unsigned long mask,
 			   unsigned long star)
@@ -419,9 +1561,13 @@ static void show_latencies(struct stats *s, char *label, char *units,
 }
 
 /* fold latency info from s into d */
-void combine_stats(struct stats *d, struct stats *s)
+static void combine_stats(struct stats *d, struct stats *s)
 {
 	int i;
+
+	/* most buffers are empty on a big box with short intervals */
+	if (s->nr_samples == 0)
+		return;
 	for (i = 0; i < PLAT_NR; i++)
 		d->plat[i] += s->plat[i];
 	d->nr_samples += s->nr_samples;
@@ -431,6 +1577,19 @@ void combine_stats(struct stats *d, struct stats *s)
 		d->min = s->min;
 }
 
+/*
+ * derive a per thread rand_r() seed from a parent seed and an index.
+ * This is splitmix64, so neighboring indexes get unrelated streams
+ */
+static unsigned int mix_seed(unsigned long long parent, unsigned long long index)
+{
+	unsigned long long z = parent + 0x9e3779b97f4a7c15ULL * (index + 1);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
 /* record a latency result into the histogram */
 static void add_lat(struct stats *s, unsigned int us)
 {
@@ -446,9 +1605,69 @@ static void add_lat(struct stats *s, unsigned int us)
 	__sync_fetch_and_add(&s->nr_samples, 1);
 }
 
+/*
+ * --spin accounting, one per thread that waits in fwait()
+ */
+struct spin_state {
+	/* waits that were posted before we had to sleep */
+	unsigned long long spin_wakes;
+	/* waits that went all the way into FUTEX_WAIT */
+	unsigned long long sleep_wakes;
+	/* time burned spinning, successful or not */
+	unsigned long long spin_time;
+	/* --spin-adaptive, current budget in usecs */
+	unsigned int budget;
+	/* the stats_reset_gen the counters above belong to */
+	unsigned long reset_gen;
+};
+
+/*
+ * --fanout, shared by a request and all of the subtasks it scattered
+ */
+struct gather {
+	/* subtasks that haven't finished yet */
+	int remaining;
+	/* the parent plus every subtask, the last one to drop it frees us */
+	int refs;
+	struct thread_data *parent;
+	struct timeval start;
+};
+
+/*
+ * --trace, the points in a request's life we log
+ */
+enum {
+	TRACE_ENQUEUE,
+	TRACE_WAKE_POST,
+	TRACE_ON_CPU,
+	TRACE_LOCK,
+	TRACE_WORK_DONE,
+};
+
+static char *trace_event_names[] = { "enqueue", "wake_post", "on_cpu",
+				     "lock", "work_done" };
+
+struct trace_event {
+	/* CLOCK_MONOTONIC, so it lines up with perf -k mono and ftrace's mono clock */
+	unsigned long long ns;
+	unsigned long long req;
+	/* the worker handling the request */
+	int worker;
+	short cpu;
+	short type;
+};
+
 struct request {
 	struct timeval start_time;
 	struct request *next;
+	/* --trace, unique id for matching up events */
+	unsigned long long id;
+	/* set when a sibling took this request off our list */
+	int stolen;
+	/* --pipeline, when we were handed to the current stage */
+	struct timeval hop_time;
+	/* --fanout, set on subtasks so we can find the parent */
+	struct gather *gather;
 };
 
 /*
@@ -475,19 +1694,194 @@ struct thread_data {
 	/* keep the futex and the wake_time in the same cacheline */
 	int futex;
 
-	/* mr axboe's magic latency histogram */
-	struct stats wakeup_stats;
-	struct stats request_stats;
+	/*
+	 * --fanout, the message thread sets this before posting us so we
+	 * can tell its wakeup apart from a sibling handing us a subtask
+	 */
+	int msg_posted;
+
+	/* --fanout, subtasks siblings have posted to us */
+	struct request *subtasks;
+
+	/* --spin, how our waits in fwait() were satisfied */
+	struct spin_state spin;
+
+	/*
+	 * mr axboe's magic latency histogram, indexed by stats_epoch & 1.
+	 * Pipeline stage workers aren't part of the flip and only use [0]
+	 */
+	struct stats wakeup_stats[2];
+	struct stats request_stats[2];
+	/* set while we're writing into the current epoch's buffer */
+	volatile int stats_busy;
+	/* the stats_reset_gen our other stats belong to */
+	unsigned long reset_gen;
 	unsigned long long loop_count;
 	unsigned long long runtime;
 	unsigned long pending;
 
+	/*
+	 * --steal, queue to completion latency of requests we ran from
+	 * our own list vs the ones we took from a sibling
+	 */
+	struct stats local_stats;
+	struct stats stolen_stats;
+	unsigned long long steals;
+	unsigned long long failed_steals;
+
+	/* --pipeline, which stage we belong to */
+	int stage;
+	/* round robin cursor for handing requests to the next stage */
+	unsigned long stage_rr;
+	/*
+	 * set by the message thread once everyone upstream of us is gone.
+	 * We drain our list and exit after that, not on stopping
+	 */
+	int stage_exit;
+	/* message threads only, the workers for stages 1 and up */
+	struct thread_data *stage_threads;
+	/* time between being handed a request and starting on it */
+	struct stats queue_stats;
+	/* last stage only, from the start of the request until it's done */
+	struct stats pipeline_stats;
+
+	/* --fanout, time from posting a subtask until it starts running */
+	struct stats subtask_stats;
+	/* --fanout, time from the scatter until the last subtask is done */
+	struct stats gather_stats;
+	/* rand_r() state, derived from --seed by whoever creates us */
+	unsigned int rand_seed;
+
+	/* how much longer our simulated network/disk sleeps took than asked */
+	struct stats overshoot_stats;
+	/*
+	 * --fibers, our user level threads, the context that schedules
+	 * them and the requests none of them has picked up yet
+	 */
+	struct fiber *fibers;
+	ucontext_t fiber_sched_ctx;
+	struct request *fiber_queue;
+	struct request *fiber_queue_tail;
+	/* from the post to a fiber starting the request, and to it finishing */
+	struct stats fiber_dispatch_stats;
+	struct stats fiber_request_stats;
+	unsigned long long fiber_switches;
+
+	/* --work-plugin, what the plugin's thread_init gave us */
+	void *plugin_data;
+	int plugin_ready;
+
+	/* --lock, how our shared lock acquisitions went */
+	struct stats lock_wait_stats;
+	struct stats lock_hold_stats;
+	struct stats lock_handoff_stats;
+	unsigned long long lock_acquires;
+	unsigned long long lock_contended;
+
+	/* --class, which one we serve and our share of its latencies */
+	struct request_class *klass;
+	struct stats class_wakeup_stats;
+	struct stats class_request_stats;
+
+	/*
+	 * --wake-pattern, set along with wake_time by whoever posts us, so
+	 * we know if our wakeup came from another group.  The message
+	 * thread keeps the cpu it started on as the group's home
+	 */
+	int wake_remote;
+	int home_cpu;
+	struct stats local_wakeup_stats;
+	struct stats remote_wakeup_stats;
+
+	/*
+	 * --request-template memory phases, how long they took and how
+	 * many page faults each one took.  --mem-mode dontneed keeps one
+	 * mapping around and zaps it every time
+	 */
+	struct stats mem_stats;
+	struct stats mem_fault_stats;
+	char *mem_buf;
+	size_t mem_buf_size;
+
+	/* --sleep-type timerfd and epoll, created when the thread starts */
+	int timer_fd;
+	int epoll_fd;
+
+	/*
+	 * --trace, our private ring of events.  Only this thread writes
+	 * it and it's only read after everyone has exited, so no locking
+	 */
+	struct trace_event *trace_events;
+	unsigned long trace_head;
+	/* the kernel's tid for us, so traces match up with perf/ftrace */
+	pid_t kernel_tid;
+	/* id of the request we're working on */
+	unsigned long long trace_req;
+
+	/*
+	 * --perf-counters, our group leader and where each counter landed
+	 * in the group's read format, -1 if we couldn't open it
+	 */
+	int perf_fd;
+	int perf_index[NR_PERF_COUNTERS];
+	int perf_nr;
+	unsigned long long perf_start[NR_PERF_COUNTERS];
+	struct stats perf_stats[NR_PERF_COUNTERS];
+	/* instructions per cycle times 100 */
+	struct stats ipc_stats;
+
+	/* --layout, the cpus our message group is allowed on, NULL for all */
+	cpu_set_t *cpus;
+	/*
+	 * --llc-stats, wakeup latencies for each LLC followed by request
+	 * latencies for each LLC, by the cpu we were on at the time
+	 */
+	struct stats *llc_stats;
+
+	/*
+	 * --churn-pct and --churn-ramp.  The churn thread sets churn_exit
+	 * and the worker leaves at the top of its loop.  A new thread
+	 * takes over the same thread_data, so stats and queued requests
+	 * carry over.  churn_parked slots get no new rps requests, and
+	 * churn_exited means there is no thread left to join
+	 */
+	volatile int churn_exit;
+	volatile int churn_parked;
+	int churn_exited;
+	pthread_t churn_tid;
+	/* when the churn thread called pthread_create for us */
+	struct timeval churn_spawn_time;
+	/* wakeups left before we stop counting as a young worker */
+	int churn_young;
+	unsigned long long churn_replaced;
+	/* on the message thread, how long pthread_create took */
+	struct stats churn_create_stats;
+	/* from pthread_create until the new worker ran */
+	struct stats churn_first_run_stats;
+	/* wakeups of workers that just started */
+	struct stats churn_young_stats;
+
 	char pipe_page[PIPE_TRANSFER_BUFFER];
 
 	/* matrices to multiply */
 	unsigned long *data;
 };
 
+/*
+ * record into one of our double buffered histograms.  stats_busy and
+ * stats_epoch are a Dekker pair with flip_thread_stats(): either the
+ * flipper sees us busy and waits, or we see the new epoch.
+ */
+static void add_thread_lat(struct thread_data *td, struct stats *s,
+			   unsigned int us)
+{
+	td->stats_busy = 1;
+	__sync_synchronize();
+	add_lat(&s[stats_epoch & 1], us);
+	__sync_synchronize();
+	td->stats_busy = 0;
+}
+
 /* we're so fancy we make our own futex wrappers */
 #define FUTEX_BLOCKED 0
 #define FUTEX_RUNNING 1
@@ -516,16 +1910,113 @@ static void fpost(int *futexp)
 	}
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+#define nop __asm__ __volatile__("rep;nop": : :"memory")
+#elif defined(__aarch64__)
+#define nop __asm__ __volatile__("yield" ::: "memory")
+#elif defined(__powerpc64__)
+#define nop __asm__ __volatile__("nop": : :"memory")
+#else
+#error Unsupported architecture
+#endif
+
+/*
+ * --spin, poll the futex for up to our spin budget before giving up
+ * and sleeping.  Returns 1 if we were posted while spinning.
+ *
+ * With --spin-adaptive the budget follows twice the average time it
+ * took for successful spins to get posted.  Waits that end up sleeping
+ * decay the budget, but it never drops below 1/16th of --spin so we
+ * keep probing.
+ */
+/*
+ * message threads wait here too, so the spin counters get their own
+ * reset check instead of riding along with stats_reset_check().  The
+ * adaptive budget isn't a stat and carries over
+ */
+static void spin_reset_check(struct spin_state *spin)
+{
+	unsigned long gen = stats_reset_gen;
+
+	if (spin->reset_gen != gen) {
+		spin->spin_wakes = 0;
+		spin->sleep_wakes = 0;
+		spin->spin_time = 0;
+		spin->reset_gen = gen;
+	}
+}
+
+static int fwait_spin(int *futexp, struct spin_state *spin)
+{
+	struct timeval start;
+	struct timeval now;
+	unsigned long long delta;
+	unsigned int budget = spin_usec;
+	unsigned long loops = 0;
+	int posted = 0;
+
+	if (spin_adaptive && spin->budget)
+		budget = spin->budget;
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		if (*futexp == FUTEX_RUNNING &&
+		    __sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
+						 FUTEX_BLOCKED)) {
+			posted = 1;
+			break;
+		}
+		nop;
+		/* gtod is cheap but not free, only check the clock now and then */
+		if ((++loops & 63) == 0) {
+			gettimeofday(&now, NULL);
+			if (tvdelta(&start, &now) >= budget)
+				break;
+		}
+	}
+	gettimeofday(&now, NULL);
+	delta = tvdelta(&start, &now);
+	spin->spin_time += delta;
+
+	if (spin_adaptive) {
+		long long sample = posted ? delta * 2 : budget / 2;
+		long long avg = budget;
+		long long floor = spin_usec / 16 ? spin_usec / 16 : 1;
+
+		avg += (sample - avg) / 8;
+		if (avg < floor)
+			avg = floor;
+		if (avg > spin_usec)
+			avg = spin_usec;
+		spin->budget = avg;
+	}
+	return posted;
+}
+
 /*
  * wait on a futex, with an optional timeout.  Make sure to set
  * the futex to FUTEX_BLOCKED beforehand.
  *
+ * If spin is non-null and --spin is set, we poll for a while before
+ * sleeping and record how the wait was satisfied.
+ *
  * This will return zero if all went well, or return -ETIMEDOUT if you
  * hit the timeout without getting posted
  */
-static int fwait(int *futexp, struct timespec *timeout)
+static int fwait(int *futexp, struct timespec *timeout,
+		 struct spin_state *spin)
 {
 	int s;
+
+	if (spin && spin_usec) {
+		spin_reset_check(spin);
+		if (fwait_spin(futexp, spin)) {
+			spin->spin_wakes++;
+			return 0;
+		}
+		spin->sleep_wakes++;
+	}
+
 	while (1) {
 		/* Is the futex available? */
 		if (__sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
@@ -582,34 +2073,40 @@ static struct thread_data *xlist_splice(struct thread_data *head)
 /*
  * cmpxchg based list prepend
  */
-static struct request *request_add(struct thread_data *head, struct request *add)
+static struct request *__request_add(struct request **head,
+				     struct request *add)
 {
 	struct request *old;
 	struct request *ret;
 
 	while (1) {
-		old = head->request;
+		old = *head;
 		add->next = old;
-		ret = __sync_val_compare_and_swap(&head->request, old, add);
+		ret = __sync_val_compare_and_swap(head, old, add);
 		if (ret == old)
 			return old;
 	}
 }
 
+static struct request *request_add(struct thread_data *head, struct request *add)
+{
+	return __request_add(&head->request, add);
+}
+
 /*
  * xchg based list splicing.  This returns the entire list and
- * replaces the head->request with NULL.  The list is reversed before
+ * replaces *head with NULL.  The list is reversed before
  * returning
  */
-static struct request *request_splice(struct thread_data *head)
+static struct request *__request_splice(struct request **head)
 {
 	struct request *old;
 	struct request *ret;
 	struct request *reverse = NULL;
 
 	while (1) {
-		old = head->request;
-		ret = __sync_val_compare_and_swap(&head->request, old, NULL);
+		old = *head;
+		ret = __sync_val_compare_and_swap(head, old, NULL);
 		if (ret == old)
 			break;
 	}
@@ -623,6 +2120,92 @@ static struct request *request_splice(struct thread_data *head)
 	return reverse;
 }
 
+static struct request *request_splice(struct thread_data *head)
+{
+	return __request_splice(&head->request);
+}
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/*
+ * --buffer-mem, allocate zeroed memory for the long lived buffers.
+ * hugetlb needs pages reserved in /proc/sys/vm/nr_hugepages, thp
+ * lines the buffer up on a huge page and asks for THP, and mlock
+ * faults everything in up front and keeps it there.
+ */
+static void *alloc_buffer(size_t size)
+{
+	size_t map_size = size;
+	char *map;
+	char *buf;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	if (buffer_mem == BUFFER_MALLOC)
+		return calloc(1, size);
+
+	if (buffer_mem == BUFFER_HUGETLB) {
+		map_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		flags |= MAP_HUGETLB;
+	} else if (buffer_mem == BUFFER_THP) {
+		/* room to line up, and the size we unmap is in front */
+		map_size = size + 2 * HUGE_PAGE_SIZE;
+	}
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (map == MAP_FAILED) {
+		if (buffer_mem == BUFFER_HUGETLB)
+			fprintf(stderr, "unable to map %lu bytes of hugetlb memory, "
+				"check /proc/sys/vm/nr_hugepages\n",
+				(unsigned long)map_size);
+		else
+			perror("unable to map buffer");
+		exit(1);
+	}
+
+	buf = map;
+	if (buffer_mem == BUFFER_THP) {
+		buf = (char *)(((unsigned long)map + 2 * HUGE_PAGE_SIZE - 1) &
+			       ~(HUGE_PAGE_SIZE - 1));
+		*(char **)(buf - sizeof(char *)) = map;
+		*(size_t *)(buf - 2 * sizeof(char *)) = map_size;
+		madvise(buf, size, MADV_HUGEPAGE);
+	} else if (buffer_mem == BUFFER_MLOCK) {
+		if (mlock(buf, size)) {
+			perror("unable to mlock buffer, check ulimit -l");
+			exit(1);
+		}
+	}
+	return buf;
+}
+
+static void free_buffer(void *ptr, size_t size)
+{
+	char *buf = ptr;
+
+	if (!buf)
+		return;
+	switch (buffer_mem) {
+	case BUFFER_MALLOC:
+		free(buf);
+		break;
+	case BUFFER_HUGETLB:
+		munmap(buf, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		break;
+	case BUFFER_THP:
+		munmap(*(char **)(buf - sizeof(char *)),
+		       *(size_t *)(buf - 2 * sizeof(char *)));
+		break;
+	case BUFFER_MLOCK:
+		munmap(buf, size);
+		break;
+	}
+}
+
+/* the three matrices do_some_math() works on */
+static size_t matrix_bytes(void)
+{
+	return 3 * sizeof(unsigned long) * matrix_size * matrix_size;
+}
+
 static struct request *allocate_request(void)
 {
 	struct request *ret = malloc(sizeof(*ret));
@@ -634,709 +2217,5046 @@ static struct request *allocate_request(void)
 
 	gettimeofday(&ret->start_time, NULL);
 	ret->next = NULL;
+	if (trace_file)
+		ret->id = __sync_add_and_fetch(&trace_request_ids, 1);
+	ret->stolen = 0;
+	ret->gather = NULL;
 	return ret;
 }
 
-
 /*
- * Wake everyone currently waiting on the message list, filling in their
- * thread_data->wake_time with the current time.
- *
- * It's not exactly the current time, it's really the time at the start of
- * the list run.  We want to detect when the scheduler is just preempting the
- * waker and giving away the rest of its timeslice.  So we gtod once at
- * the start of the loop and use that for all the threads we wake.
- *
- * Since pipe mode ends up measuring this other ways, we do the gtod
- * every time in pipe mode
+ * --steal, called by an idle worker before it blocks.  Walk our
+ * siblings starting with the one after us and splice away the first
+ * pending list we find.  The victim's list is a lock free stack, so
+ * instead of a Chase-Lev deque pop we take the whole thing with the
+ * same xchg the owner uses.
  */
-static void xlist_wake_all(struct thread_data *td)
+static struct request *steal_requests(struct thread_data *td)
 {
-	struct thread_data *list;
-	struct thread_data *next;
-	struct timeval now;
+	struct thread_data *siblings = td->msg_thread + 1;
+	struct request *req;
+	struct request *tmp;
+	int me = td - siblings;
+	int i;
 
-	list = xlist_splice(td);
-	gettimeofday(&now, NULL);
-	while (list) {
-		next = list->next;
-		list->next = NULL;
-		if (pipe_test) {
-			memset(list->pipe_page, 1, pipe_test);
-			gettimeofday(&list->wake_time, NULL);
-		} else {
-			memcpy(&list->wake_time, &now, sizeof(now));
-		}
-		fpost(&list->futex);
-		list = next;
+	for (i = 1; i < worker_threads; i++) {
+		struct thread_data *victim = siblings + (me + i) % worker_threads;
+
+		/* don't bounce the cacheline around with a cmpxchg for nothing */
+		if (!victim->request)
+			continue;
+		req = request_splice(victim);
+		if (!req)
+			continue;
+		for (tmp = req; tmp; tmp = tmp->next)
+			tmp->stolen = 1;
+		td->steals++;
+		return req;
 	}
+	td->failed_steals++;
+	return NULL;
 }
 
+
 /*
- * called by worker threads to send a message and wait for the answer.
- * In reality we're just trading one cacheline with the gtod and futex in
- * it, but that's good enough.  We gtod after waking and use that to
- * record scheduler latency.
+ * --trace, map this thread's event ring.  Each thread calls this
+ * before it can record anything
  */
-static struct request *msg_and_wait(struct thread_data *td)
+static void trace_init(struct thread_data *td)
 {
-	struct request *req;
-	struct timeval now;
-	unsigned long long delta;
-
-	if (pipe_test)
-		memset(td->pipe_page, 2, pipe_test);
-
-	/* set ourselves to blocked */
-	td->futex = FUTEX_BLOCKED;
-	gettimeofday(&td->wake_time, NULL);
-
-	/* add us to the list */
-	if (requests_per_sec) {
-		td->pending = 0;
-		req = request_splice(td);
-		if (req) {
-			td->futex = FUTEX_RUNNING;
-			return req;
-		}
-	} else {
-		xlist_add(td->msg_thread, td);
-	}
-
-	fpost(&td->msg_thread->futex);
+	td->kernel_tid = syscall(SYS_gettid);
+	/* churned workers keep the ring of the thread they replaced */
+	if (!trace_file || td->trace_events)
+		return;
 
-	/*
-	 * don't wait if the main threads are shutting down,
-	 * they will never kick us fpost has a full barrier, so as long
-	 * as the message thread walks his list after setting stopping,
-	 * we shouldn't miss the wakeup
-	 */
-	if (!stopping) {
-		/* if he hasn't already woken us up, wait */
-		fwait(&td->futex, NULL);
+	td->trace_events = mmap(NULL, trace_entries * sizeof(struct trace_event),
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (td->trace_events == MAP_FAILED) {
+		perror("unable to map trace ring");
+		exit(1);
 	}
-	gettimeofday(&now, NULL);
-	delta = tvdelta(&td->wake_time, &now);
-	if (delta > 0)
-		add_lat(&td->wakeup_stats, delta);
+}
 
-	return NULL;
+static void trace_open_marker(void)
+{
+	trace_marker_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY);
+	if (trace_marker_fd < 0)
+		trace_marker_fd = open("/sys/kernel/debug/tracing/trace_marker",
+				       O_WRONLY);
+	if (trace_marker_fd < 0)
+		perror("unable to open trace_marker, continuing without it");
 }
 
 /*
- * read /proc/stat, return the percentage of non-idle time since
- * the last read.
+ * --trace, log one event into our ring.  The ring just wraps, the
+ * export only has the most recent trace_entries events per thread
  */
-float read_busy(int fd, char *buf, int len,
-		unsigned long long *total_time_ret,
-		unsigned long long *idle_time_ret)
+static void trace_event(struct thread_data *td, int type,
+			unsigned long long req, pid_t worker)
 {
-	unsigned long long total_time = 0;
-	unsigned long long idle_time = 0;
-	unsigned long long delta;
-	unsigned long long delta_idle;
-	unsigned long long val;
-	int col = 1;
-	int ret;
-	char *c;
-	char *save = NULL;
+	struct trace_event *ev;
+	struct timespec ts;
+	int cpu;
 
+	if (!td->trace_events)
+		return;
 
-	ret = lseek(fd, 0, SEEK_SET);
-	if (ret < 0) {
-		perror("lseek");
-		exit(1);
-	}
-	ret = read(fd, buf, len-1);
-	if (ret < 0) {
-		perror("failed to read /proc/stat");
-		exit(1);
-	}
-	buf[ret] = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	cpu = sched_getcpu();
+	ev = td->trace_events + td->trace_head % trace_entries;
+	ev->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->req = req;
+	ev->worker = worker;
+	ev->cpu = cpu;
+	ev->type = type;
+	__sync_synchronize();
+	td->trace_head++;
 
-	/* find the newline */
-	c = strchr(buf, '\n');
-	if (c == NULL) {
-		perror("unable to parse /proc/stat");
-		exit(1);
-	}
-	*c = '\0';
+	if (trace_marker_fd >= 0) {
+		char buf[128];
+		int len;
 
-	/* cpu  590315893 45841886 375984879 82585100131 166708940 0 5453892 0 0 0 */
-	c = strtok_r(buf, " ", &save);
-	if (strcmp(c, "cpu") != 0) {
-		perror("unable to parse summary in /proc/stat");
-		exit(1);
+		len = snprintf(buf, sizeof(buf), "schbench_%s: req=%llu worker=%d\n",
+			       trace_event_names[type], req, worker);
+		if (write(trace_marker_fd, buf, len) < 0) {
+			close(trace_marker_fd);
+			trace_marker_fd = -1;
+		}
 	}
 
-	while (c != NULL) {
-		c = strtok_r(NULL, " ", &save);
-		if (!c)
-			break;
-		val = atoll(c);
-		if (col++ == 4)
-			idle_time = val;
-		total_time += val;
+#ifdef HAVE_SDT
+	switch (type) {
+	case TRACE_ENQUEUE:
+		DTRACE_PROBE3(schbench, enqueue, req, worker, cpu);
+		break;
+	case TRACE_WAKE_POST:
+		DTRACE_PROBE3(schbench, wake_post, req, worker, cpu);
+		break;
+	case TRACE_ON_CPU:
+		DTRACE_PROBE3(schbench, on_cpu, req, worker, cpu);
+		break;
+	case TRACE_LOCK:
+		DTRACE_PROBE3(schbench, lock, req, worker, cpu);
+		break;
+	case TRACE_WORK_DONE:
+		DTRACE_PROBE3(schbench, work_done, req, worker, cpu);
+		break;
 	}
+#endif
+}
 
-	if (*total_time_ret == 0) {
-		*total_time_ret = total_time;
-		*idle_time_ret = idle_time;
-		return 0.0;
-	}
+/* trace_export() tags each event with the thread that logged it */
+struct trace_export_event {
+	struct trace_event ev;
+	pid_t tid;
+};
+
+static int trace_event_cmp(const void *a, const void *b)
+{
+	const struct trace_export_event *ea = a;
+	const struct trace_export_event *eb = b;
 
-	/* delta is the total time spent doing everything */
-	delta = total_time - *total_time_ret;
-	delta_idle = idle_time - *idle_time_ret;
+	if (ea->ev.ns < eb->ev.ns)
+		return -1;
+	return ea->ev.ns > eb->ev.ns;
+}
 
-	*total_time_ret = total_time;
-	*idle_time_ret = idle_time;
+/* copy the live part of one thread's ring into the export array */
+static unsigned long trace_gather(struct thread_data *td,
+				  struct trace_export_event *all,
+				  unsigned long nr)
+{
+	unsigned long count = td->trace_head;
+	unsigned long first = 0;
+	unsigned long i;
 
-	return 100.00 - ((float)delta_idle/(float)delta) * 100.00;
+	if (!td->trace_events)
+		return nr;
+	if (count > trace_entries)
+		first = count - trace_entries;
+	for (i = first; i < count; i++) {
+		all[nr].ev = td->trace_events[i % trace_entries];
+		all[nr].tid = td->kernel_tid;
+		nr++;
+	}
+	return nr;
 }
 
-#if defined(__x86_64__) || defined(__i386__)
-#define nop __asm__ __volatile__("rep;nop": : :"memory")
-#elif defined(__aarch64__)
-#define nop __asm__ __volatile__("yield" ::: "memory")
-#elif defined(__powerpc64__)
-#define nop __asm__ __volatile__("nop": : :"memory")
-#else
-#error Unsupported architecture
-#endif
+/*
+ * --trace, merge every thread's ring and write it out in time order.
+ * The lines are laid out like ftrace's text output, so they can be
+ * sorted together with perf script or trace-cmd report output that
+ * used the monotonic clock.  Each message thread also has
+ * nr_stage_threads pipeline stage threads hanging off it
+ */
+static void trace_export(struct thread_data *thread_data, int nr_threads,
+			 int nr_stage_threads)
+{
+	struct trace_export_event *all;
+	unsigned long nr = 0;
+	unsigned long i;
+	int t;
+	int s;
+	FILE *fp;
+
+	all = calloc((unsigned long)(nr_threads + message_threads * nr_stage_threads) *
+		     trace_entries, sizeof(*all));
+	if (!all) {
+		perror("unable to allocate trace export");
+		return;
+	}
+	for (t = 0; t < nr_threads; t++) {
+		struct thread_data *td = thread_data + t;
+
+		nr = trace_gather(td, all, nr);
+		if (!td->stage_threads)
+			continue;
+		for (s = 0; s < nr_stage_threads; s++)
+			nr = trace_gather(td->stage_threads + s, all, nr);
+	}
+	qsort(all, nr, sizeof(*all), trace_event_cmp);
+
+	fp = fopen(trace_file, "w");
+	if (!fp) {
+		perror("unable to open trace file");
+		free(all);
+		return;
+	}
+	fprintf(fp, "# clock: CLOCK_MONOTONIC\n");
+	fprintf(fp, "#  TASK-PID     CPU#   TIMESTAMP  EVENT\n");
+	for (i = 0; i < nr; i++) {
+		struct trace_event *ev = &all[i].ev;
+
+		fprintf(fp, "schbench-%d [%03d] %llu.%06llu: schbench_%s: req=%llu worker=%d\n",
+			all[i].tid, ev->cpu, ev->ns / 1000000000ULL,
+			(ev->ns % 1000000000ULL) / 1000,
+			trace_event_names[ev->type], ev->req, ev->worker);
+	}
+	fclose(fp);
+	free(all);
+}
+
+static void trace_free(struct thread_data *td)
+{
+	if (td->trace_events)
+		munmap(td->trace_events, trace_entries * sizeof(struct trace_event));
+	td->trace_events = NULL;
+}
 
 /*
- * once the message thread starts all his children, this is where he
- * loops until our runtime is up.  Basically this sits around waiting
- * for posting by the worker threads, and replying to their messages.
+ * --perf-counters, what each worker counts.  Any counter the kernel or
+ * hardware won't give us is just left out of the group.
  */
-static void run_msg_thread(struct thread_data *td)
+struct perf_counter_def {
+	char *label;
+	char *units;
+	unsigned int type;
+	unsigned long long config;
+	/* divide by this before putting it in the histogram */
+	unsigned long scale;
+};
+
+#define PERF_HW_CACHE(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+static struct perf_counter_def perf_counter_defs[NR_PERF_COUNTERS] = {
+	{ "Cycles", "thousands", PERF_TYPE_HARDWARE,
+	  PERF_COUNT_HW_CPU_CYCLES, 1000 },
+	{ "Instructions", "thousands", PERF_TYPE_HARDWARE,
+	  PERF_COUNT_HW_INSTRUCTIONS, 1000 },
+	{ "LLC Misses", "misses", PERF_TYPE_HARDWARE,
+	  PERF_COUNT_HW_CACHE_MISSES, 1 },
+	{ "L1D Misses", "misses", PERF_TYPE_HW_CACHE,
+	  PERF_HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+			PERF_COUNT_HW_CACHE_RESULT_MISS), 1 },
+	{ "Context Switches", "switches", PERF_TYPE_SOFTWARE,
+	  PERF_COUNT_SW_CONTEXT_SWITCHES, 1 },
+	{ "Migrations", "migrations", PERF_TYPE_SOFTWARE,
+	  PERF_COUNT_SW_CPU_MIGRATIONS, 1 },
+	{ "dTLB Load Misses", "misses", PERF_TYPE_HW_CACHE,
+	  PERF_HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+			PERF_COUNT_HW_CACHE_RESULT_MISS), 1 },
+	{ "dTLB Store Misses", "misses", PERF_TYPE_HW_CACHE,
+	  PERF_HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_WRITE,
+			PERF_COUNT_HW_CACHE_RESULT_MISS), 1 },
+};
+
+/* the ipc histogram needs to find these two */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+			   int group_fd, unsigned long flags)
 {
-	while (1) {
-		td->futex = FUTEX_BLOCKED;
-		xlist_wake_all(td);
+	return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
 
-		if (stopping) {
-			xlist_wake_all(td);
-			break;
+/*
+ * --perf-counters, open one counter group for the calling thread.  The
+ * first counter that opens becomes the leader, and anything we aren't
+ * allowed to count (VMs, perf_event_paranoid) is skipped.  If we can't
+ * count kernel time we retry user only.
+ */
+static void perf_init(struct thread_data *td)
+{
+	struct perf_event_attr attr;
+	unsigned int i;
+	int fd;
+
+	td->perf_fd = -1;
+	td->perf_nr = 0;
+	if (!perf_counters)
+		return;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		td->perf_index[i] = -1;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_counter_defs[i].type;
+		attr.config = perf_counter_defs[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = td->perf_fd < 0;
+		attr.exclude_hv = 1;
+
+		fd = perf_event_open(&attr, 0, -1, td->perf_fd, 0);
+		if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+			attr.exclude_kernel = 1;
+			fd = perf_event_open(&attr, 0, -1, td->perf_fd, 0);
 		}
-		fwait(&td->futex, NULL);
+		if (fd < 0)
+			continue;
+		if (td->perf_fd < 0)
+			td->perf_fd = fd;
+		td->perf_index[i] = td->perf_nr++;
+	}
+
+	if (td->perf_fd < 0) {
+		perror("perf_event_open, continuing without perf counters");
+		return;
 	}
+	ioctl(td->perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
 }
 
-void auto_scale_rps(int *proc_stat_fd,
-		    unsigned long long *total_time,
-		    unsigned long long *total_idle)
+/* read the whole group at once, values are in perf_counter_defs order */
+static int perf_read(struct thread_data *td, unsigned long long *values)
 {
-	int fd = *proc_stat_fd;
-	float busy = 0;
-	char proc_stat_buf[512];
-	int first_run = 0;
-	float delta;
-	float target = 1;
+	unsigned long long buf[1 + NR_PERF_COUNTERS];
+	unsigned int i;
+	int ret;
 
-	if (fd == -1) {
-		fd = open("/proc/stat", O_RDONLY);
-		if (fd < 0) {
-			perror("unable to open /proc/stat");
-			exit(1);
-		}
-		*proc_stat_fd = fd;
-		first_run = 1;
+	if (td->perf_fd < 0)
+		return -1;
+	ret = read(td->perf_fd, buf, sizeof(buf));
+	if (ret < (int)sizeof(unsigned long long) * (1 + td->perf_nr))
+		return -1;
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (td->perf_index[i] >= 0)
+			values[i] = buf[1 + td->perf_index[i]];
 	}
-	busy = read_busy(fd, proc_stat_buf, 512, total_time, total_idle);
-	if (first_run)
+	return 0;
+}
+
+static void perf_request_start(struct thread_data *td)
+{
+	if (td->perf_fd >= 0)
+		perf_read(td, td->perf_start);
+}
+
+/* record the counter deltas for the request that just finished */
+static void perf_request_done(struct thread_data *td)
+{
+	unsigned long long now[NR_PERF_COUNTERS];
+	unsigned long long delta[NR_PERF_COUNTERS];
+	unsigned int i;
+
+	if (td->perf_fd < 0 || perf_read(td, now))
 		return;
-	if (busy < auto_rps) {
-		delta = (float)auto_rps / busy;
-		/* delta is > 1 */
-		if (delta > 3) {
-			delta = 3;
-		} else if (delta < 1.2) {
-			delta = 1 + (delta - 1) / 8;
-			if (delta < 1.05 && !auto_rps_target_hit) {
-				auto_rps_target_hit = 1;
-				memset(&rps_stats, 0, sizeof(rps_stats));
-			}
 
-		} else if (delta < 1.5) {
-			delta = 1 + (delta - 1) / 4;
-		}
-		target = ceilf((float)requests_per_sec * delta);
-		if (target >= (1ULL << 31)) {
-			/*
-			 * sometimes we don't have enough threads to hit the
-			 * target load
-			 */
-			target = requests_per_sec;
-		}
-	} else if (busy > auto_rps) {
-		/* delta < 1 */
-		delta = (float)auto_rps / busy;
-		if (delta < 0.3) {
-			delta = 0.3;
-		} else if (delta > .9) {
-			delta += (1 - delta) / 8;
-			if (delta > .95 && !auto_rps_target_hit) {
-				auto_rps_target_hit = 1;
-				memset(&rps_stats, 0, sizeof(rps_stats));
-			}
-		} else if (delta > .8) {
-			delta += (1 - delta) / 4;
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (td->perf_index[i] < 0)
+			continue;
+		delta[i] = now[i] - td->perf_start[i];
+		add_lat(&td->perf_stats[i], delta[i] / perf_counter_defs[i].scale);
+	}
+	if (td->perf_index[PERF_CYCLES] >= 0 &&
+	    td->perf_index[PERF_INSTRUCTIONS] >= 0 && delta[PERF_CYCLES])
+		add_lat(&td->ipc_stats,
+			delta[PERF_INSTRUCTIONS] * 100 / delta[PERF_CYCLES]);
+}
+
+/*
+ * Wake everyone currently waiting on the message list, filling in their
+ * thread_data->wake_time with the current time.
+ *
+ * It's not exactly the current time, it's really the time at the start of
+ * the list run.  We want to detect when the scheduler is just preempting the
+ * waker and giving away the rest of its timeslice.  So we gtod once at
+ * the start of the loop and use that for all the threads we wake.
+ *
+ * Since pipe mode ends up measuring this other ways, we do the gtod
+ * every time in pipe mode
+ */
+static void xlist_wake_all(struct thread_data *td)
+{
+	struct thread_data *list;
+	struct thread_data *next;
+	struct timeval now;
+
+	list = xlist_splice(td);
+	gettimeofday(&now, NULL);
+	while (list) {
+		next = list->next;
+		list->next = NULL;
+		if (pipe_test) {
+			memset(list->pipe_page, 1, pipe_test);
+			gettimeofday(&list->wake_time, NULL);
+		} else {
+			memcpy(&list->wake_time, &now, sizeof(now));
 		}
-		target = floorf((float)requests_per_sec * delta);
-		if (target <= 0)
-			target = 0;
-	} else {
-		target = requests_per_sec;
-		if (!auto_rps_target_hit) {
-			auto_rps_target_hit = 1;
-			memset(&rps_stats, 0, sizeof(rps_stats));
+		list->msg_posted = 1;
+		if (trace_file) {
+			list->trace_req = __sync_add_and_fetch(&trace_request_ids, 1);
+			trace_event(td, TRACE_WAKE_POST, list->trace_req,
+				    list->kernel_tid);
 		}
+		fpost(&list->futex);
+		list = next;
 	}
-	requests_per_sec = target;
 }
 
+static void run_subtasks(struct thread_data *td);
+static void llc_add_lat(struct thread_data *td, int request, unsigned int us);
+
 /*
- * once the message thread starts all his children, this is where he
- * loops until our runtime is up.  Basically this sits around waiting
- * for posting by the worker threads, replying to their messages.
+ * --fanout, siblings post subtasks on the same futex our own wakeups
+ * come in on.  Tell a real post (from the message or rps thread) apart
+ * from a sibling handing us a subtask.
  */
-static void run_rps_thread(struct thread_data *worker_threads_mem)
+static int fanout_posted(struct thread_data *td)
 {
-	/* start and end of the thread run */
-	struct timeval start;
+	if (requests_per_sec)
+		return td->request != NULL;
+	return td->msg_posted;
+}
+
+/*
+ * the stats that aren't double buffered, cleared by their own thread.
+ * Pipeline stage workers keep everything here, they aren't part of the
+ * epoch flip
+ */
+static void clear_extra_stats(struct thread_data *td)
+{
+	memset(&td->local_stats, 0, sizeof(td->local_stats));
+	memset(&td->stolen_stats, 0, sizeof(td->stolen_stats));
+	td->steals = 0;
+	td->failed_steals = 0;
+	memset(&td->subtask_stats, 0, sizeof(td->subtask_stats));
+	memset(&td->gather_stats, 0, sizeof(td->gather_stats));
+	memset(&td->overshoot_stats, 0, sizeof(td->overshoot_stats));
+	memset(td->perf_stats, 0, sizeof(td->perf_stats));
+	memset(&td->ipc_stats, 0, sizeof(td->ipc_stats));
+	memset(&td->mem_stats, 0, sizeof(td->mem_stats));
+	memset(&td->mem_fault_stats, 0, sizeof(td->mem_fault_stats));
+	memset(&td->local_wakeup_stats, 0, sizeof(td->local_wakeup_stats));
+	memset(&td->remote_wakeup_stats, 0, sizeof(td->remote_wakeup_stats));
+	memset(&td->class_wakeup_stats, 0, sizeof(td->class_wakeup_stats));
+	memset(&td->class_request_stats, 0, sizeof(td->class_request_stats));
+	memset(&td->fiber_dispatch_stats, 0, sizeof(td->fiber_dispatch_stats));
+	memset(&td->fiber_request_stats, 0, sizeof(td->fiber_request_stats));
+	td->fiber_switches = 0;
+	memset(&td->lock_wait_stats, 0, sizeof(td->lock_wait_stats));
+	memset(&td->lock_hold_stats, 0, sizeof(td->lock_hold_stats));
+	memset(&td->lock_handoff_stats, 0, sizeof(td->lock_handoff_stats));
+	td->lock_acquires = 0;
+	td->lock_contended = 0;
+	memset(&td->churn_first_run_stats, 0, sizeof(td->churn_first_run_stats));
+	memset(&td->churn_young_stats, 0, sizeof(td->churn_young_stats));
+	if (td->stage) {
+		memset(&td->wakeup_stats[0], 0, sizeof(td->wakeup_stats[0]));
+		memset(&td->request_stats[0], 0, sizeof(td->request_stats[0]));
+		memset(&td->queue_stats, 0, sizeof(td->queue_stats));
+		memset(&td->pipeline_stats, 0, sizeof(td->pipeline_stats));
+	}
+}
+
+/*
+ * called by a thread before it records anything for a request.  If the
+ * stats were reset since the last time, throw away what we have
+ */
+static void stats_reset_check(struct thread_data *td)
+{
+	unsigned long gen = stats_reset_gen;
+
+	if (td->reset_gen != gen) {
+		clear_extra_stats(td);
+		td->reset_gen = gen;
+	}
+}
+
+/* a worker got the cpu delta usecs after it was posted */
+static void record_wakeup(struct thread_data *td, unsigned long long delta)
+{
+	stats_reset_check(td);
+	add_thread_lat(td, td->wakeup_stats, delta);
+	llc_add_lat(td, 0, delta);
+	if (td->churn_young) {
+		td->churn_young--;
+		add_lat(&td->churn_young_stats, delta);
+	}
+	if (td->klass)
+		add_lat(&td->class_wakeup_stats, delta);
+	if (wake_pattern != WAKE_LOCAL) {
+		if (td->wake_remote)
+			add_lat(&td->remote_wakeup_stats, delta);
+		else
+			add_lat(&td->local_wakeup_stats, delta);
+	}
+}
+
+/*
+ * called by worker threads to send a message and wait for the answer.
+ * In reality we're just trading one cacheline with the gtod and futex in
+ * it, but that's good enough.  We gtod after waking and use that to
+ * record scheduler latency.
+ */
+static struct request *msg_and_wait(struct thread_data *td)
+{
+	struct request *req;
 	struct timeval now;
-	struct request *request;
 	unsigned long long delta;
 
-	/* how long do we sleep between each wake */
-	unsigned long sleep_time;
-	int batch = 8;
-	int cur_tid = 0;
-	int i;
-
-	while (1) {
-		gettimeofday(&start, NULL);
-		sleep_time = (USEC_PER_SEC / requests_per_sec) * batch;
-		for (i = 1; i < requests_per_sec + 1; i++) {
-			struct thread_data *worker;
+	if (pipe_test)
+		memset(td->pipe_page, 2, pipe_test);
 
-			gettimeofday(&now, NULL);
+	/* set ourselves to blocked */
+	td->futex = FUTEX_BLOCKED;
+	gettimeofday(&td->wake_time, NULL);
 
-			worker = worker_threads_mem + cur_tid % worker_threads;
-			cur_tid++;
+	/*
+	 * run anything siblings gave us while we were busy.  Any subtask
+	 * that shows up after this will find us FUTEX_BLOCKED and post us
+	 */
+	if (fanout) {
+		td->msg_posted = 0;
+		run_subtasks(td);
+	}
 
-			/* at some point, there's just too much, don't queue more */
-			if (worker->pending > 8) {
-				continue;
-			}
-			worker->pending++;
-			request = allocate_request();
-			request_add(worker, request);
-			memcpy(&worker->wake_time, &now, sizeof(now));
-			fpost(&worker->futex);
-			if ((i % batch) == 0)
-				usleep(sleep_time);
+	/* add us to the list */
+	if (requests_per_sec) {
+		td->pending = 0;
+		req = request_splice(td);
+		if (!req && work_steal)
+			req = steal_requests(td);
+		if (req) {
+			td->futex = FUTEX_RUNNING;
+			return req;
 		}
-		gettimeofday(&now, NULL);
+	} else {
+		xlist_add(td->msg_thread, td);
+	}
 
-		delta = tvdelta(&start, &now);
-		while (delta < USEC_PER_SEC) {
-			delta = USEC_PER_SEC - delta;
-			usleep(delta);
+	fpost(&td->msg_thread->futex);
 
-			gettimeofday(&now, NULL);
-			delta = tvdelta(&start, &now);
-		}
+	/*
+	 * don't wait if the main threads are shutting down,
+	 * they will never kick us fpost has a full barrier, so as long
+	 * as the message thread walks his list after setting stopping,
+	 * we shouldn't miss the wakeup
+	 */
+	if (!stopping) {
+		/* if he hasn't already woken us up, wait */
+		fwait(&td->futex, NULL, &td->spin);
 
-		if (stopping) {
-			for (i = 0; i < worker_threads; i++)
-				fpost(&worker_threads_mem[i].futex);
-			break;
+		/* subtasks from siblings don't count as our wakeup */
+		while (fanout && !fanout_posted(td) && !stopping &&
+		       !td->churn_exit) {
+			run_subtasks(td);
+			if (fanout_posted(td))
+				break;
+			fwait(&td->futex, NULL, &td->spin);
 		}
 	}
+	/* churn_retire() woke us to exit, that's not a real wakeup */
+	if (td->churn_exit)
+		return NULL;
+	gettimeofday(&now, NULL);
+	delta = tvdelta(&td->wake_time, &now);
+	if (delta > 0)
+		record_wakeup(td, delta);
 
-	if (auto_rps)
-		fprintf(stderr, "final rps goal was %d\n", requests_per_sec);
+	return NULL;
 }
 
 /*
- * multiply two matrices in a naive way to emulate some cache footprint
+ * --cpuidle-stats, the idle state and frequency counters for every
+ * cpu at one point in time
  */
-static void do_some_math(struct thread_data *thread_data)
-{
-	unsigned long i, j, k;
-	unsigned long *m1, *m2, *m3;
+struct cpuidle_snapshot {
+	struct timeval time;
+	/* nr_cpus * MAX_CSTATES, indexed cpu * MAX_CSTATES + state */
+	unsigned long long *usage;
+	unsigned long long *residency;
+	/* scaling_cur_freq in kHz, 0 if we couldn't read it */
+	unsigned long long *freq;
+};
 
-	m1 = &thread_data->data[0];
-	m2 = &thread_data->data[matrix_size * matrix_size];
-	m3 = &thread_data->data[2 * matrix_size * matrix_size];
+static int cpuidle_nr_cpus;
+static int cpuidle_nr_states;
+static char cpuidle_names[MAX_CSTATES][32];
+static struct cpuidle_snapshot cpuidle_run_start;
+static int cpu_dma_latency_fd = -1;
 
-	for (i = 0; i < matrix_size; i++) {
-		for (j = 0; j < matrix_size; j++) {
+/* read one number out of a sysfs file, returns -1 if it isn't there */
+static int read_sysfs_ull(char *path, unsigned long long *val)
+{
+	char buf[64];
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+	*val = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+/*
+ * find out how many idle states there are and what they're called.
+ * We assume every cpu has the same states as cpu0
+ */
+static void cpuidle_init(void)
+{
+	char path[256];
+	int fd;
+	int ret;
+	int i;
+
+	cpuidle_nr_cpus = get_nprocs_conf();
+	for (i = 0; i < MAX_CSTATES; i++) {
+		char *c;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu0/cpuidle/state%d/name", i);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			break;
+		ret = read(fd, cpuidle_names[i], sizeof(cpuidle_names[i]) - 1);
+		close(fd);
+		if (ret < 0)
+			ret = 0;
+		cpuidle_names[i][ret] = '\0';
+		c = strchr(cpuidle_names[i], '\n');
+		if (c)
+			*c = '\0';
+	}
+	cpuidle_nr_states = i;
+	if (!cpuidle_nr_states)
+		fprintf(stderr, "no cpuidle states in sysfs, only reporting cpufreq\n");
+}
+
+static void cpuidle_snapshot_alloc(struct cpuidle_snapshot *snap)
+{
+	int nr = cpuidle_nr_cpus * MAX_CSTATES;
+
+	snap->usage = calloc(nr, sizeof(unsigned long long));
+	snap->residency = calloc(nr, sizeof(unsigned long long));
+	snap->freq = calloc(cpuidle_nr_cpus, sizeof(unsigned long long));
+	if (!snap->usage || !snap->residency || !snap->freq) {
+		perror("unable to allocate cpuidle stats");
+		exit(1);
+	}
+}
+
+static void cpuidle_snapshot_free(struct cpuidle_snapshot *snap)
+{
+	free(snap->usage);
+	free(snap->residency);
+	free(snap->freq);
+}
+
+static void cpuidle_read(struct cpuidle_snapshot *snap)
+{
+	char path[256];
+	int cpu;
+	int state;
+
+	gettimeofday(&snap->time, NULL);
+	for (cpu = 0; cpu < cpuidle_nr_cpus; cpu++) {
+		for (state = 0; state < cpuidle_nr_states; state++) {
+			int i = cpu * MAX_CSTATES + state;
+
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/usage",
+				 cpu, state);
+			if (read_sysfs_ull(path, &snap->usage[i]))
+				snap->usage[i] = 0;
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/time",
+				 cpu, state);
+			if (read_sysfs_ull(path, &snap->residency[i]))
+				snap->residency[i] = 0;
+		}
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+		if (read_sysfs_ull(path, &snap->freq[cpu]))
+			snap->freq[cpu] = 0;
+	}
+}
+
+/*
+ * print C-state entries per second and the share of cpu time spent in
+ * each state between two snapshots, plus the current cpu frequencies
+ */
+static void show_cpuidle_stats(struct cpuidle_snapshot *old,
+			       struct cpuidle_snapshot *cur)
+{
+	unsigned long long elapsed = tvdelta(&old->time, &cur->time);
+	unsigned long long freq_min = 0;
+	unsigned long long freq_max = 0;
+	unsigned long long freq_sum = 0;
+	int freq_cpus = 0;
+	int cpu;
+	int state;
+
+	if (!elapsed)
+		return;
+
+	for (state = 0; state < cpuidle_nr_states; state++) {
+		unsigned long long usage = 0;
+		unsigned long long residency = 0;
+
+		for (cpu = 0; cpu < cpuidle_nr_cpus; cpu++) {
+			int i = cpu * MAX_CSTATES + state;
+
+			usage += cur->usage[i] - old->usage[i];
+			residency += cur->residency[i] - old->residency[i];
+		}
+		fprintf(stderr, "\tcstate %-8s entries/s: %-10.0f residency: %.2f%%\n",
+			cpuidle_names[state],
+			(double)usage * USEC_PER_SEC / elapsed,
+			(double)residency * 100 / (elapsed * cpuidle_nr_cpus));
+	}
+
+	for (cpu = 0; cpu < cpuidle_nr_cpus; cpu++) {
+		unsigned long long freq = cur->freq[cpu];
+
+		if (!freq)
+			continue;
+		if (!freq_cpus || freq < freq_min)
+			freq_min = freq;
+		if (freq > freq_max)
+			freq_max = freq;
+		freq_sum += freq;
+		freq_cpus++;
+	}
+	if (freq_cpus)
+		fprintf(stderr, "\tcpufreq MHz avg: %llu min: %llu max: %llu\n",
+			freq_sum / freq_cpus / 1000, freq_min / 1000,
+			freq_max / 1000);
+}
+
+/*
+ * --cpu-dma-latency, the pm qos request only lasts as long as we keep
+ * the file open, so we hold it until exit
+ */
+static void set_cpu_dma_latency(void)
+{
+	int val = cpu_dma_latency;
+
+	cpu_dma_latency_fd = open("/dev/cpu_dma_latency", O_WRONLY);
+	if (cpu_dma_latency_fd < 0) {
+		perror("unable to open /dev/cpu_dma_latency");
+		setup_fail();
+	}
+	if (write(cpu_dma_latency_fd, &val, sizeof(val)) != sizeof(val)) {
+		perror("unable to set cpu_dma_latency");
+		setup_fail();
+	}
+	fprintf(stderr, "cpu_dma_latency set to %d usec\n", val);
+}
+
+/*
+ * --layout and --llc-stats, what we know about each possible cpu.
+ * llc is a dense index into the LLC domains, -1 for offline cpus
+ */
+struct cpu_topology {
+	int llc;
+	int core;
+	int pcore;
+	int node;
+	unsigned long long package_id;
+	unsigned long long core_id;
+};
+
+static struct cpu_topology *cpu_topo;
+static int topo_nr_cpus;
+static int nr_llcs;
+/* what identifies each LLC, the first cpu in its shared_cpu_list */
+static int *llc_key;
+/* --layout, the cpus each message group is pinned to */
+static cpu_set_t **group_cpus;
+static size_t group_cpus_size;
+
+/* read a sysfs cpu list like 0-3,8-11 into a cpu_set */
+static int read_cpulist(char *path, cpu_set_t *set, size_t size)
+{
+	char buf[4096];
+	char *save;
+	char *tok;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+
+	CPU_ZERO_S(size, set);
+	for (tok = strtok_r(buf, ",\n", &save); tok;
+	     tok = strtok_r(NULL, ",\n", &save)) {
+		int first;
+		int last;
+		int cpu;
+
+		if (sscanf(tok, "%d-%d", &first, &last) != 2)
+			last = first = atoi(tok);
+		for (cpu = first; cpu <= last && cpu < topo_nr_cpus; cpu++)
+			CPU_SET_S(cpu, size, set);
+	}
+	return 0;
+}
+
+/* the shared_cpu_list of the highest level data or unified cache */
+static int read_llc_cpus(int cpu, cpu_set_t *set, size_t size)
+{
+	char path[256];
+	char type[32];
+	int best_level = -1;
+	int best_index = -1;
+	int index;
+
+	for (index = 0; ; index++) {
+		unsigned long long level;
+		int fd;
+		int ret;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 cpu, index);
+		if (read_sysfs_ull(path, &level))
+			break;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/type",
+			 cpu, index);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		ret = read(fd, type, sizeof(type) - 1);
+		close(fd);
+		if (ret <= 0 || strncmp(type, "Instruction", 11) == 0)
+			continue;
+		if ((int)level > best_level) {
+			best_level = level;
+			best_index = index;
+		}
+	}
+	if (best_index < 0)
+		return -1;
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+		 cpu, best_index);
+	return read_cpulist(path, set, size);
+}
+
+/*
+ * P-cores on hybrid parts.  Intel lists them in the cpu_core pmu,
+ * elsewhere the biggest cpu_capacity wins.  If neither is there, every
+ * core counts as a P-core
+ */
+static void find_pcores(cpu_set_t *online, size_t size)
+{
+	cpu_set_t *pcores = CPU_ALLOC(topo_nr_cpus);
+	unsigned long long max_capacity = 0;
+	unsigned long long capacity[topo_nr_cpus];
+	char path[256];
+	int found = 0;
+	int cpu;
+
+	if (!pcores) {
+		perror("CPU_ALLOC");
+		setup_fail();
+	}
+	if (read_cpulist("/sys/devices/cpu_core/cpus", pcores, size) == 0) {
+		for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+			cpu_topo[cpu].pcore = CPU_ISSET_S(cpu, size, pcores);
+			found |= cpu_topo[cpu].pcore;
+		}
+	}
+	CPU_FREE(pcores);
+	if (found)
+		return;
+
+	for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+		capacity[cpu] = 0;
+		if (!CPU_ISSET_S(cpu, size, online))
+			continue;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpu_capacity", cpu);
+		if (read_sysfs_ull(path, capacity + cpu) == 0 &&
+		    capacity[cpu] > max_capacity)
+			max_capacity = capacity[cpu];
+	}
+	for (cpu = 0; cpu < topo_nr_cpus; cpu++)
+		cpu_topo[cpu].pcore = !max_capacity || capacity[cpu] == max_capacity;
+}
+
+static void topology_init(void)
+{
+	size_t size;
+	cpu_set_t *online;
+	cpu_set_t *llc;
+	int cpu;
+	int i;
+
+	topo_nr_cpus = get_nprocs_conf();
+	size = CPU_ALLOC_SIZE(topo_nr_cpus);
+	group_cpus_size = size;
+	cpu_topo = calloc(topo_nr_cpus, sizeof(*cpu_topo));
+	llc_key = calloc(topo_nr_cpus, sizeof(int));
+	online = CPU_ALLOC(topo_nr_cpus);
+	llc = CPU_ALLOC(topo_nr_cpus);
+	if (!cpu_topo || !llc_key || !online || !llc) {
+		perror("unable to allocate topology");
+		setup_fail();
+	}
+
+	if (read_cpulist("/sys/devices/system/cpu/online", online, size)) {
+		CPU_ZERO_S(size, online);
+		for (cpu = 0; cpu < get_nprocs(); cpu++)
+			CPU_SET_S(cpu, size, online);
+	}
+
+	for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+		struct cpu_topology *t = cpu_topo + cpu;
+		char path[256];
+		int key;
+
+		t->llc = -1;
+		if (!CPU_ISSET_S(cpu, size, online))
+			continue;
+
+		t->core_id = cpu;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		read_sysfs_ull(path, &t->package_id);
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		read_sysfs_ull(path, &t->core_id);
+
+		/* the first cpu on the same package and core names the core */
+		t->core = cpu;
+		for (i = 0; i < cpu; i++) {
+			if (cpu_topo[i].llc >= 0 &&
+			    cpu_topo[i].package_id == t->package_id &&
+			    cpu_topo[i].core_id == t->core_id) {
+				t->core = cpu_topo[i].core;
+				break;
+			}
+		}
+
+		/* without cache info, the package is the best guess */
+		if (read_llc_cpus(cpu, llc, size) == 0) {
+			for (key = 0; key < topo_nr_cpus; key++) {
+				if (CPU_ISSET_S(key, size, llc))
+					break;
+			}
+		} else {
+			key = topo_nr_cpus + t->package_id;
+		}
+
+		/* LLCs are numbered in the order we find them */
+		for (t->llc = 0; t->llc < nr_llcs; t->llc++) {
+			if (llc_key[t->llc] == key)
+				break;
+		}
+		if (t->llc == nr_llcs)
+			llc_key[nr_llcs++] = key;
+	}
+	find_pcores(online, size);
+
+	/* numa nodes can be sparse, so look at every possible one */
+	for (i = 0; i < topo_nr_cpus * 4 && i < 1024; i++) {
+		char path[256];
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", i);
+		if (read_cpulist(path, llc, size))
+			continue;
+		for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+			if (CPU_ISSET_S(cpu, size, llc))
+				cpu_topo[cpu].node = i;
+		}
+	}
+	CPU_FREE(online);
+	CPU_FREE(llc);
+}
+
+/* which LLC a cpu belongs to, 0 if we can't tell */
+static int cpu_to_llc(int cpu)
+{
+	if (cpu < 0 || cpu >= topo_nr_cpus || cpu_topo[cpu].llc < 0)
+		return 0;
+	return cpu_topo[cpu].llc;
+}
+
+/* print a cpu set the way sysfs does, 0-3,8-11 */
+static void print_cpulist(FILE *fp, cpu_set_t *set)
+{
+	int cpu;
+	int first = -1;
+	int comma = 0;
+
+	for (cpu = 0; cpu <= topo_nr_cpus; cpu++) {
+		int set_bit = cpu < topo_nr_cpus &&
+			      CPU_ISSET_S(cpu, group_cpus_size, set);
+
+		if (set_bit && first < 0)
+			first = cpu;
+		if (set_bit || first < 0)
+			continue;
+		fprintf(fp, "%s%d", comma ? "," : "", first);
+		if (cpu - 1 > first)
+			fprintf(fp, "-%d", cpu - 1);
+		comma = 1;
+		first = -1;
+	}
+}
+
+/*
+ * --layout, carve the machine up into one cpu set per message group.
+ *
+ * llc: one group per LLC domain.  Without -m we use one group per LLC,
+ *      otherwise groups go round robin over the LLCs.
+ * core: one cpu from each physical core, so no group shares a core
+ *       with itself through SMT, split evenly between the groups
+ * pcore: only the big cores on hybrid parts, split evenly
+ *
+ * The even splits walk the cpus in LLC order so each group stays as
+ * cache local as it can.  If -t wasn't given, every group gets as many
+ * workers as it has cpus.
+ */
+static void layout_init(void)
+{
+	int *order;
+	int nr_allowed = 0;
+	int max_count = 0;
+	int llc;
+	int cpu;
+	int i;
+
+	if (layout == LAYOUT_LLC && !message_threads_set)
+		message_threads = nr_llcs;
+
+	order = calloc(topo_nr_cpus, sizeof(int));
+	group_cpus = calloc(message_threads, sizeof(cpu_set_t *));
+	if (!order || !group_cpus) {
+		perror("unable to allocate layout");
+		setup_fail();
+	}
+	for (i = 0; i < message_threads; i++) {
+		group_cpus[i] = CPU_ALLOC(topo_nr_cpus);
+		if (!group_cpus[i]) {
+			perror("CPU_ALLOC");
+			setup_fail();
+		}
+		CPU_ZERO_S(group_cpus_size, group_cpus[i]);
+	}
+
+	for (llc = 0; llc < nr_llcs; llc++) {
+		for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+			if (cpu_topo[cpu].llc != llc)
+				continue;
+			if (layout == LAYOUT_CORE && cpu_topo[cpu].core != cpu)
+				continue;
+			if (layout == LAYOUT_PCORE && !cpu_topo[cpu].pcore)
+				continue;
+			order[nr_allowed++] = cpu;
+		}
+	}
+
+	for (i = 0; i < nr_allowed; i++) {
+		int group;
+
+		cpu = order[i];
+		if (layout == LAYOUT_LLC) {
+			for (group = cpu_topo[cpu].llc; group < message_threads;
+			     group += nr_llcs)
+				CPU_SET_S(cpu, group_cpus_size, group_cpus[group]);
+			/* more LLCs than groups, the leftovers go unused */
+			continue;
+		}
+		group = (long)i * message_threads / nr_allowed;
+		CPU_SET_S(cpu, group_cpus_size, group_cpus[group]);
+	}
+
+	for (i = 0; i < message_threads; i++) {
+		int count = CPU_COUNT_S(group_cpus_size, group_cpus[i]);
+
+		if (count == 0) {
+			fprintf(stderr, "--layout %s: not enough cpus for %d message threads\n",
+				layout_names[layout], message_threads);
+			setup_fail();
+		}
+		if (count > max_count)
+			max_count = count;
+		fprintf(stderr, "layout %s: group %d on cpus ",
+			layout_names[layout], i);
+		print_cpulist(stderr, group_cpus[i]);
+		fprintf(stderr, "\n");
+	}
+	if (worker_threads == 0) {
+		worker_threads = max_count;
+		fprintf(stderr, "setting worker threads to %d\n", worker_threads);
+	}
+	free(order);
+}
+
+/* pin the calling thread to its message group's cpus */
+static void layout_apply(struct thread_data *td)
+{
+	int ret;
+
+	if (!td->cpus)
+		return;
+	ret = pthread_setaffinity_np(pthread_self(), group_cpus_size, td->cpus);
+	if (ret) {
+		fprintf(stderr, "error %d setting affinity\n", ret);
+		exit(1);
+	}
+}
+
+static void llc_stats_init(struct thread_data *td)
+{
+	if (!llc_stats || td->llc_stats)
+		return;
+	td->llc_stats = calloc(nr_llcs * 2, sizeof(struct stats));
+	if (!td->llc_stats) {
+		perror("unable to allocate llc stats");
+		exit(1);
+	}
+}
+
+static void llc_add_lat(struct thread_data *td, int request, unsigned int us)
+{
+	if (!td->llc_stats)
+		return;
+	add_lat(td->llc_stats + request * nr_llcs + cpu_to_llc(sched_getcpu()), us);
+}
+
+/* --llc-stats, one line per LLC with wakeup and request percentiles */
+static void show_llc_stats(struct thread_data *thread_data)
+{
+	struct stats *total = calloc(nr_llcs * 2, sizeof(struct stats));
+	cpu_set_t *set = CPU_ALLOC(topo_nr_cpus);
+	int nr_threads = message_threads * worker_threads + message_threads;
+	int llc;
+	int i;
+
+	if (!total || !set) {
+		perror("unable to allocate llc stats");
+		exit(1);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		struct thread_data *td = thread_data + i;
+
+		if (!td->llc_stats)
+			continue;
+		for (llc = 0; llc < nr_llcs * 2; llc++)
+			combine_stats(total + llc, td->llc_stats + llc);
+		free(td->llc_stats);
+		td->llc_stats = NULL;
+	}
+
+	fprintf(stderr, "per LLC latencies (usec):\n");
+	for (llc = 0; llc < nr_llcs; llc++) {
+		struct stats *wakeup = total + llc;
+		struct stats *request = total + nr_llcs + llc;
+		int cpu;
+
+		CPU_ZERO_S(group_cpus_size, set);
+		for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+			if (cpu_topo[cpu].llc == llc)
+				CPU_SET_S(cpu, group_cpus_size, set);
+		}
+		fprintf(stderr, "\tllc %d (cpus ", llc);
+		print_cpulist(stderr, set);
+		fprintf(stderr, "): wakeup %lu samples p50 %u p99 %u, "
+			"request %lu samples p50 %u p99 %u\n",
+			wakeup->nr_samples, stats_percentile(wakeup, 50.0),
+			stats_percentile(wakeup, 99.0),
+			request->nr_samples, stats_percentile(request, 50.0),
+			stats_percentile(request, 99.0));
+	}
+	free(total);
+	CPU_FREE(set);
+}
+
+/*
+ * --cpu-stats and -A.  The columns of /proc/stat we care about, guest
+ * time is already included in user and nice so we leave it out
+ */
+enum {
+	CPU_USER,
+	CPU_NICE,
+	CPU_SYSTEM,
+	CPU_IDLE,
+	CPU_IOWAIT,
+	CPU_IRQ,
+	CPU_SOFTIRQ,
+	CPU_STEAL,
+	NR_CPU_TIMES,
+};
+
+struct cpu_times {
+	unsigned long long t[NR_CPU_TIMES];
+};
+
+/* auto_scale_rps() state between calls */
+struct auto_rps_state {
+	struct cpu_times last;
+	unsigned long long self_usec;
+	int primed;
+};
+
+/* --cpu-stats, max softirq types we track */
+#define MAX_SOFTIRQS 16
+
+/*
+ * --cpu-stats, everything we know about each cpu at one point in time.
+ * times[0] is the summary line and times[cpu + 1] is each cpu
+ */
+struct cpu_stat_snapshot {
+	struct timeval time;
+	struct cpu_times *times;
+	unsigned long long *irqs;
+	/* [cpu * MAX_SOFTIRQS + type] */
+	unsigned long long *softirqs;
+};
+
+static int cpustat_nr_cpus;
+static int nr_softirq_types;
+static char softirq_names[MAX_SOFTIRQS][16];
+static struct cpu_stat_snapshot cpustat_run_start;
+
+/*
+ * read all of a /proc file.  The buffer grows as needed and is reused
+ * between calls
+ */
+static char *read_proc_file(char *path, char **buf, size_t *size)
+{
+	size_t len = 0;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	while (1) {
+		if (len + 1 >= *size) {
+			*size = *size ? *size * 2 : 16384;
+			*buf = realloc(*buf, *size);
+			if (!*buf) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ret = read(fd, *buf + len, *size - len - 1);
+		if (ret < 0) {
+			fprintf(stderr, "failed to read %s: %s\n", path,
+				strerror(errno));
+			exit(1);
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	close(fd);
+	(*buf)[len] = '\0';
+	return *buf;
+}
+
+/*
+ * fill times[] from /proc/stat, the summary line first and then each
+ * cpu, up to nr entries.  Cpus that are offline keep their old values
+ */
+static void read_proc_stat(struct cpu_times *times, int nr)
+{
+	static char *buf;
+	static size_t size;
+	char *line;
+	char *save = NULL;
+
+	read_proc_file("/proc/stat", &buf, &size);
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		struct cpu_times *t;
+		char *c;
+		int index = 0;
+		int i;
+
+		/* cpu  590315893 45841886 375984879 82585100131 ... */
+		if (strncmp(line, "cpu", 3) != 0)
+			break;
+		c = line + 3;
+		if (*c != ' ')
+			index = strtol(c, &c, 10) + 1;
+		if (index >= nr)
+			continue;
+		t = times + index;
+		for (i = 0; i < NR_CPU_TIMES; i++)
+			t->t[i] = strtoull(c, &c, 10);
+	}
+}
+
+/*
+ * the header of /proc/softirqs and /proc/interrupts names the cpu for
+ * each column, since offline cpus are left out
+ */
+static int read_cpu_columns(char *header, int *cols, int max)
+{
+	int nr = 0;
+	char *c = header;
+
+	while ((c = strstr(c, "CPU")) != NULL && nr < max) {
+		c += 3;
+		cols[nr++] = strtol(c, &c, 10);
+	}
+	return nr;
+}
+
+static void read_softirqs(struct cpu_stat_snapshot *snap, int *cols)
+{
+	static char *buf;
+	static size_t size;
+	char *line;
+	char *save = NULL;
+	int nr_cols;
+	int type = 0;
+
+	read_proc_file("/proc/softirqs", &buf, &size);
+	line = strtok_r(buf, "\n", &save);
+	if (!line)
+		return;
+	nr_cols = read_cpu_columns(line, cols, cpustat_nr_cpus);
+	while ((line = strtok_r(NULL, "\n", &save)) && type < MAX_SOFTIRQS) {
+		char *c = strchr(line, ':');
+		int i;
+
+		if (!c)
+			continue;
+		*c = '\0';
+		if (type >= nr_softirq_types) {
+			snprintf(softirq_names[type], sizeof(softirq_names[type]),
+				 "%s", line + strspn(line, " "));
+			nr_softirq_types = type + 1;
+		}
+		c++;
+		for (i = 0; i < nr_cols; i++) {
+			if (cols[i] < cpustat_nr_cpus)
+				snap->softirqs[cols[i] * MAX_SOFTIRQS + type] =
+					strtoull(c, &c, 10);
+		}
+		type++;
+	}
+}
+
+/* total interrupts per cpu, every source added together */
+static void read_interrupts(struct cpu_stat_snapshot *snap, int *cols)
+{
+	static char *buf;
+	static size_t size;
+	char *line;
+	char *save = NULL;
+	int nr_cols;
+	int cpu;
+
+	read_proc_file("/proc/interrupts", &buf, &size);
+	line = strtok_r(buf, "\n", &save);
+	if (!line)
+		return;
+	nr_cols = read_cpu_columns(line, cols, cpustat_nr_cpus);
+	for (cpu = 0; cpu < cpustat_nr_cpus; cpu++)
+		snap->irqs[cpu] = 0;
+	while ((line = strtok_r(NULL, "\n", &save))) {
+		char *c = strchr(line, ':');
+		int i;
+
+		if (!c)
+			continue;
+		c++;
+		/* ERR and MIS only have one total, they stop early */
+		for (i = 0; i < nr_cols; i++) {
+			char *end;
+			unsigned long long val = strtoull(c, &end, 10);
+
+			if (end == c)
+				break;
+			c = end;
+			if (cols[i] < cpustat_nr_cpus)
+				snap->irqs[cols[i]] += val;
+		}
+	}
+}
+
+static void cpustat_snapshot_alloc(struct cpu_stat_snapshot *snap)
+{
+	if (!cpustat_nr_cpus)
+		cpustat_nr_cpus = get_nprocs_conf();
+	snap->times = calloc(cpustat_nr_cpus + 1, sizeof(struct cpu_times));
+	snap->irqs = calloc(cpustat_nr_cpus, sizeof(unsigned long long));
+	snap->softirqs = calloc(cpustat_nr_cpus * MAX_SOFTIRQS,
+				sizeof(unsigned long long));
+	if (!snap->times || !snap->irqs || !snap->softirqs) {
+		perror("unable to allocate cpu stats");
+		exit(1);
+	}
+}
+
+static void cpustat_snapshot_free(struct cpu_stat_snapshot *snap)
+{
+	free(snap->times);
+	free(snap->irqs);
+	free(snap->softirqs);
+}
+
+static void cpustat_read(struct cpu_stat_snapshot *snap)
+{
+	int cols[cpustat_nr_cpus];
+
+	gettimeofday(&snap->time, NULL);
+	read_proc_stat(snap->times, cpustat_nr_cpus + 1);
+	read_softirqs(snap, cols);
+	read_interrupts(snap, cols);
+}
+
+static void show_cpu_times(char *label, struct cpu_times *old,
+			   struct cpu_times *cur)
+{
+	unsigned long long delta[NR_CPU_TIMES];
+	unsigned long long total = 0;
+	double pct;
+	int i;
+
+	for (i = 0; i < NR_CPU_TIMES; i++) {
+		delta[i] = cur->t[i] - old->t[i];
+		total += delta[i];
+	}
+	if (!total)
+		return;
+	pct = 100.0 / total;
+	fprintf(stderr, "\t%-6s busy %5.1f%% usr %5.1f sys %5.1f irq %5.1f "
+		"sirq %5.1f steal %5.1f iowait %5.1f", label,
+		100 - (delta[CPU_IDLE] + delta[CPU_IOWAIT]) * pct,
+		(delta[CPU_USER] + delta[CPU_NICE]) * pct,
+		delta[CPU_SYSTEM] * pct, delta[CPU_IRQ] * pct,
+		delta[CPU_SOFTIRQ] * pct, delta[CPU_STEAL] * pct,
+		delta[CPU_IOWAIT] * pct);
+}
+
+/*
+ * --cpu-stats, one line per cpu with where its time went, plus the
+ * interrupt and softirq rates and its busiest softirq
+ */
+static void show_cpu_stats(struct cpu_stat_snapshot *old,
+			   struct cpu_stat_snapshot *cur)
+{
+	double secs = (double)tvdelta(&old->time, &cur->time) / USEC_PER_SEC;
+	char label[16];
+	int cpu;
+
+	if (secs <= 0)
+		return;
+	show_cpu_times("all", old->times, cur->times);
+	fprintf(stderr, "\n");
+	for (cpu = 0; cpu < cpustat_nr_cpus; cpu++) {
+		unsigned long long *old_sirq = old->softirqs + cpu * MAX_SOFTIRQS;
+		unsigned long long *cur_sirq = cur->softirqs + cpu * MAX_SOFTIRQS;
+		unsigned long long sirqs = 0;
+		unsigned long long top = 0;
+		int top_type = -1;
+		int type;
+
+		if (cur->times[cpu + 1].t[CPU_IDLE] == 0 &&
+		    cur->times[cpu + 1].t[CPU_USER] == 0)
+			continue;
+		snprintf(label, sizeof(label), "cpu%d", cpu);
+		show_cpu_times(label, old->times + cpu + 1, cur->times + cpu + 1);
+
+		for (type = 0; type < nr_softirq_types; type++) {
+			unsigned long long d = cur_sirq[type] - old_sirq[type];
+
+			sirqs += d;
+			if (d > top) {
+				top = d;
+				top_type = type;
+			}
+		}
+		fprintf(stderr, " irqs/s %.0f sirqs/s %.0f",
+			(cur->irqs[cpu] - old->irqs[cpu]) / secs, sirqs / secs);
+		if (top_type >= 0)
+			fprintf(stderr, " (%s %.0f)", softirq_names[top_type],
+				top / secs);
+		fprintf(stderr, "\n");
+	}
+}
+
+/*
+ * --energy, the RAPL powercap zones we found.  AMD's RAPL shows up
+ * under the same intel-rapl names.  Package and dram zones add up to
+ * the total, the others (core, uncore, psys) overlap with them and are
+ * only shown on their own
+ */
+#define MAX_ENERGY_DOMAINS 32
+struct energy_domain {
+	char name[64];
+	char path[256];
+	unsigned long long max_range;
+	int in_total;
+};
+static struct energy_domain energy_domains[MAX_ENERGY_DOMAINS];
+static int nr_energy_domains;
+
+struct energy_snapshot {
+	struct timeval time;
+	unsigned long long uj[MAX_ENERGY_DOMAINS];
+	unsigned long long requests;
+};
+static struct energy_snapshot energy_run_start;
+
+static void energy_add_domain(char *zone)
+{
+	struct energy_domain *d = energy_domains + nr_energy_domains;
+	char path[256];
+	unsigned long long uj;
+	int fd;
+	int ret;
+
+	if (nr_energy_domains == MAX_ENERGY_DOMAINS)
+		return;
+	snprintf(d->path, sizeof(d->path), "%s/energy_uj", zone);
+	/* energy_uj is usually root only */
+	if (read_sysfs_ull(d->path, &uj))
+		return;
+	snprintf(path, sizeof(path), "%s/max_energy_range_uj", zone);
+	if (read_sysfs_ull(path, &d->max_range))
+		d->max_range = 0;
+
+	snprintf(path, sizeof(path), "%s/name", zone);
+	fd = open(path, O_RDONLY);
+	ret = fd < 0 ? -1 : read(fd, d->name, sizeof(d->name) - 1);
+	if (fd >= 0)
+		close(fd);
+	if (ret <= 0)
+		ret = snprintf(d->name, sizeof(d->name), "%s", strrchr(zone, '/') + 1);
+	d->name[ret] = '\0';
+	d->name[strcspn(d->name, "\n")] = '\0';
+
+	d->in_total = strncmp(d->name, "package", 7) == 0 ||
+		      strncmp(d->name, "dram", 4) == 0;
+	nr_energy_domains++;
+}
+
+/* find the zones, if there aren't any we just turn --energy off */
+static void energy_init(void)
+{
+	char zone[64];
+	char sub[128];
+	int i;
+	int j;
+
+	for (i = 0; ; i++) {
+		snprintf(zone, sizeof(zone),
+			 "/sys/class/powercap/intel-rapl:%d", i);
+		if (access(zone, F_OK))
+			break;
+		energy_add_domain(zone);
+		for (j = 0; ; j++) {
+			snprintf(sub, sizeof(sub), "%s/intel-rapl:%d:%d", zone, i, j);
+			if (access(sub, F_OK))
+				break;
+			energy_add_domain(sub);
+		}
+	}
+	if (!nr_energy_domains) {
+		fprintf(stderr, "no readable RAPL powercap zones, "
+			"turning off --energy\n");
+		energy_stats = 0;
+		return;
+	}
+	/* no package or dram zones, count whatever we have */
+	for (i = 0; i < nr_energy_domains; i++) {
+		if (energy_domains[i].in_total)
+			return;
+	}
+	for (i = 0; i < nr_energy_domains; i++)
+		energy_domains[i].in_total = 1;
+}
+
+static void energy_read(struct energy_snapshot *snap,
+			unsigned long long requests)
+{
+	int i;
+
+	gettimeofday(&snap->time, NULL);
+	snap->requests = requests;
+	for (i = 0; i < nr_energy_domains; i++) {
+		if (read_sysfs_ull(energy_domains[i].path, &snap->uj[i]))
+			snap->uj[i] = 0;
+	}
+}
+
+/* joules, average watts and requests per joule between two snapshots */
+static void show_energy_stats(struct energy_snapshot *old,
+			      struct energy_snapshot *cur)
+{
+	double secs = (double)tvdelta(&old->time, &cur->time) / USEC_PER_SEC;
+	double total = 0;
+	int i;
+
+	if (secs <= 0)
+		return;
+	for (i = 0; i < nr_energy_domains; i++) {
+		unsigned long long uj = cur->uj[i] - old->uj[i];
+
+		/* the counter wrapped */
+		if (cur->uj[i] < old->uj[i])
+			uj += energy_domains[i].max_range;
+		if (energy_domains[i].in_total)
+			total += uj / 1000000.0;
+		fprintf(stderr, "\t%s: %.2f J %.2f W\n", energy_domains[i].name,
+			uj / 1000000.0, uj / 1000000.0 / secs);
+	}
+	fprintf(stderr, "energy: %.2f J avg %.2f W requests per joule: %.2f\n",
+		total, total / secs,
+		total > 0 ? (cur->requests - old->requests) / total : 0);
+}
+
+/*
+ * once the message thread starts all his children, this is where he
+ * loops until our runtime is up.  Basically this sits around waiting
+ * for posting by the worker threads, and replying to their messages.
+ */
+static void run_msg_thread(struct thread_data *td)
+{
+	while (1) {
+		td->futex = FUTEX_BLOCKED;
+		xlist_wake_all(td);
+
+		if (stopping) {
+			xlist_wake_all(td);
+			break;
+		}
+		fwait(&td->futex, NULL, &td->spin);
+	}
+}
+
+/*
+ * how busy the box was since the last call, in percent.  Normally that's
+ * everything but idle and iowait.  With --auto-rps-exclude it's only our
+ * own cpu time, out of the time the hypervisor actually gave us, so
+ * steal, irqs, softirqs and everyone else's load don't count as ours
+ */
+static float auto_rps_busy(struct auto_rps_state *st)
+{
+	struct cpu_times now;
+	struct rusage ru;
+	unsigned long long self_usec;
+	unsigned long long delta[NR_CPU_TIMES];
+	unsigned long long total = 0;
+	int primed = st->primed;
+	int i;
+
+	read_proc_stat(&now, 1);
+	getrusage(RUSAGE_SELF, &ru);
+	self_usec = ru.ru_utime.tv_sec * USEC_PER_SEC + ru.ru_utime.tv_usec +
+		    ru.ru_stime.tv_sec * USEC_PER_SEC + ru.ru_stime.tv_usec;
+
+	for (i = 0; i < NR_CPU_TIMES; i++) {
+		delta[i] = now.t[i] - st->last.t[i];
+		total += delta[i];
+	}
+	st->last = now;
+	st->primed = 1;
+	self_usec -= st->self_usec;
+	st->self_usec += self_usec;
+
+	if (!primed || total == 0)
+		return -1;
+	if (auto_rps_exclude) {
+		double usec_per_tick = (double)USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+
+		total -= delta[CPU_STEAL];
+		if (total == 0)
+			return -1;
+		return (double)self_usec * 100 / (total * usec_per_tick);
+	}
+	return 100.0 - (float)(delta[CPU_IDLE] + delta[CPU_IOWAIT]) * 100 / total;
+}
+
+static void auto_scale_rps(struct auto_rps_state *st)
+{
+	float busy = 0;
+	float delta;
+	float target = 1;
+
+	busy = auto_rps_busy(st);
+	if (busy < 0)
+		return;
+	if (busy < auto_rps) {
+		delta = (float)auto_rps / busy;
+		/* delta is > 1 */
+		if (delta > 3) {
+			delta = 3;
+		} else if (delta < 1.2) {
+			delta = 1 + (delta - 1) / 8;
+			if (delta < 1.05 && !auto_rps_target_hit) {
+				auto_rps_target_hit = 1;
+				memset(&rps_stats, 0, sizeof(rps_stats));
+			}
+
+		} else if (delta < 1.5) {
+			delta = 1 + (delta - 1) / 4;
+		}
+		target = ceilf((float)requests_per_sec * delta);
+		if (target >= (1ULL << 31)) {
+			/*
+			 * sometimes we don't have enough threads to hit the
+			 * target load
+			 */
+			target = requests_per_sec;
+		}
+	} else if (busy > auto_rps) {
+		/* delta < 1 */
+		delta = (float)auto_rps / busy;
+		if (delta < 0.3) {
+			delta = 0.3;
+		} else if (delta > .9) {
+			delta += (1 - delta) / 8;
+			if (delta > .95 && !auto_rps_target_hit) {
+				auto_rps_target_hit = 1;
+				memset(&rps_stats, 0, sizeof(rps_stats));
+			}
+		} else if (delta > .8) {
+			delta += (1 - delta) / 4;
+		}
+		target = floorf((float)requests_per_sec * delta);
+		if (target <= 0)
+			target = 0;
+	} else {
+		target = requests_per_sec;
+		if (!auto_rps_target_hit) {
+			auto_rps_target_hit = 1;
+			memset(&rps_stats, 0, sizeof(rps_stats));
+		}
+	}
+	requests_per_sec = target;
+}
+
+/* every thread, so --wake-pattern can find the other groups */
+static struct thread_data *all_threads;
+
+/*
+ * the message threads wait here once they know their home cpu, so
+ * nobody sends a request before every group's home_cpu is set
+ */
+static pthread_barrier_t home_barrier;
+
+static struct thread_data *group_msg_thread(int group)
+{
+	return all_threads + group * (worker_threads + 1);
+}
+
+/* the cpu a group calls home, its layout or where its message thread started */
+static int group_home_cpu(int group)
+{
+	int cpu;
+
+	if (group_cpus) {
+		for (cpu = 0; cpu < topo_nr_cpus; cpu++) {
+			if (CPU_ISSET_S(cpu, group_cpus_size, group_cpus[group]))
+				return cpu;
+		}
+	}
+	return group_msg_thread(group)->home_cpu;
+}
+
+/* are two groups far enough apart for remote-llc or remote-node */
+static int groups_remote(int a, int b)
+{
+	int cpu_a = group_home_cpu(a);
+	int cpu_b = group_home_cpu(b);
+
+	if (cpu_a < 0 || cpu_b < 0 || cpu_a >= topo_nr_cpus ||
+	    cpu_b >= topo_nr_cpus)
+		return 0;
+	if (wake_pattern == WAKE_REMOTE_NODE)
+		return cpu_topo[cpu_a].node != cpu_topo[cpu_b].node;
+	return cpu_topo[cpu_a].llc != cpu_topo[cpu_b].llc;
+}
+
+/*
+ * --wake-pattern, which group gets our next request.  remote-llc and
+ * remote-node walk the ring from the next group until they find one
+ * that's far enough away, and fall back to the plain ring if there
+ * isn't one
+ */
+static int pick_wake_group(struct thread_data *td, int cur_group)
+{
+	int me = (td - all_threads) / (worker_threads + 1);
+	int i;
+
+	switch (wake_pattern) {
+	case WAKE_RANDOM:
+		return rand_r(&td->rand_seed) % message_threads;
+	case WAKE_RING:
+		return (me + 1) % message_threads;
+	case WAKE_REMOTE_LLC:
+	case WAKE_REMOTE_NODE:
+		for (i = 1; i <= message_threads; i++) {
+			int group = (cur_group + i) % message_threads;
+
+			if (group != me && groups_remote(me, group))
+				return group;
+		}
+		return (me + 1) % message_threads;
+	}
+	return me;
+}
+
+/*
+ * --class, pick the class for the n'th request of this second.  The
+ * one furthest behind its share of the total goes next, which spreads
+ * each class's requests evenly over the second
+ */
+static int pick_class(int *sent, int n)
+{
+	long long best_deficit = 0;
+	int best = 0;
+	int total = 0;
+	int i;
+
+	for (i = 0; i < nr_classes; i++)
+		total += classes[i].rps;
+	for (i = 0; i < nr_classes; i++) {
+		long long deficit = (long long)classes[i].rps * n -
+				    (long long)sent[i] * total;
+
+		if (i == 0 || deficit > best_deficit) {
+			best_deficit = deficit;
+			best = i;
+		}
+	}
+	sent[best]++;
+	return best;
+}
+
+/*
+ * once the message thread starts all his children, this is where he
+ * loops until our runtime is up.  Basically this sits around waiting
+ * for posting by the worker threads, replying to their messages.
+ */
+static void run_rps_thread(struct thread_data *worker_threads_mem)
+{
+	/* start and end of the thread run */
+	struct timeval start;
+	struct timeval now;
+	struct request *request;
+	unsigned long long delta;
+
+	/* how long do we sleep between each wake */
+	unsigned long sleep_time;
+	int batch = 8;
+	int cur_tid = 0;
+	int cur_group = 0;
+	struct thread_data *td = worker_threads_mem - 1;
+	struct thread_data *group_workers = worker_threads_mem;
+	/* --class, what we've sent each class this second */
+	int class_sent[MAX_CLASSES];
+	int class_cur[MAX_CLASSES];
+	int i;
+
+	memset(class_cur, 0, sizeof(class_cur));
+
+	while (1) {
+		gettimeofday(&start, NULL);
+		sleep_time = (USEC_PER_SEC / requests_per_sec) * batch;
+		memset(class_sent, 0, sizeof(class_sent));
+		for (i = 1; i < requests_per_sec + 1; i++) {
+			struct thread_data *worker;
+
+			gettimeofday(&now, NULL);
+
+			if (wake_pattern != WAKE_LOCAL) {
+				cur_group = pick_wake_group(td, cur_group);
+				group_workers = group_msg_thread(cur_group) + 1;
+			}
+			if (nr_classes) {
+				int c = pick_class(class_sent, i);
+
+				worker = group_workers + classes[c].offset +
+					 class_cur[c]++ % classes[c].workers;
+			} else {
+				worker = group_workers + cur_tid % worker_threads;
+				cur_tid++;
+			}
+			while (worker->churn_parked) {
+				worker = group_workers + cur_tid % worker_threads;
+				cur_tid++;
+			}
+
+			/*
+			 * at some point, there's just too much, don't queue more.
+			 * Fibers keep one request each in flight on top of that
+			 */
+			if (worker->pending > 8 + (unsigned long)fibers) {
+				continue;
+			}
+			/* other groups may be posting to this worker too */
+			__sync_fetch_and_add(&worker->pending, 1);
+			request = allocate_request();
+			request_add(worker, request);
+			trace_event(td, TRACE_ENQUEUE, request->id,
+				    worker->kernel_tid);
+			memcpy(&worker->wake_time, &now, sizeof(now));
+			worker->wake_remote = worker->msg_thread != td;
+			trace_event(td, TRACE_WAKE_POST, request->id,
+				    worker->kernel_tid);
+			fpost(&worker->futex);
+			if ((i % batch) == 0)
+				usleep(sleep_time);
+		}
+		gettimeofday(&now, NULL);
+
+		delta = tvdelta(&start, &now);
+		while (delta < USEC_PER_SEC) {
+			delta = USEC_PER_SEC - delta;
+			usleep(delta);
+
+			gettimeofday(&now, NULL);
+			delta = tvdelta(&start, &now);
+		}
+
+		if (stopping) {
+			for (i = 0; i < worker_threads; i++)
+				fpost(&worker_threads_mem[i].futex);
+			break;
+		}
+	}
+
+	if (auto_rps)
+		fprintf(stderr, "final rps goal was %d\n", requests_per_sec);
+}
+
+/*
+ * multiply two matrices in a naive way to emulate some cache footprint
+ */
+static void do_some_math(struct thread_data *thread_data)
+{
+	unsigned long i, j, k;
+	unsigned long *m1, *m2, *m3;
+
+	m1 = &thread_data->data[0];
+	m2 = &thread_data->data[matrix_size * matrix_size];
+	m3 = &thread_data->data[2 * matrix_size * matrix_size];
+
+	for (i = 0; i < matrix_size; i++) {
+		for (j = 0; j < matrix_size; j++) {
 			m3[i * matrix_size + j] = 0;
 
-			for (k = 0; k < matrix_size; k++)
-				m3[i * matrix_size + j] +=
-					m1[i * matrix_size + k] *
-					m2[k * matrix_size + j];
+			for (k = 0; k < matrix_size; k++)
+				m3[i * matrix_size + j] +=
+					m1[i * matrix_size + k] *
+					m2[k * matrix_size + j];
+		}
+	}
+}
+
+static pthread_mutex_t *lock_this_cpu(void)
+{
+	int cpu;
+	int cur_cpu;
+	pthread_mutex_t *lock;
+
+again:
+	cpu = sched_getcpu();
+	if (cpu < 0) {
+		perror("sched_getcpu failed\n");
+		exit(1);
+	}
+	lock = &per_cpu_locks[cpu].lock;
+	while (pthread_mutex_trylock(lock) != 0)
+		nop;
+
+	cur_cpu = sched_getcpu();
+	if (cur_cpu < 0) {
+		perror("sched_getcpu failed\n");
+		exit(1);
+	}
+
+	if (cur_cpu != cpu) {
+		/* we got the lock but we migrated */
+		pthread_mutex_unlock(lock);
+		goto again;
+	}
+	return lock;
+
+}
+
+/*
+ * ops worth of request work, the matrix math or whatever --work-plugin
+ * does instead
+ */
+static void do_ops(struct thread_data *td, unsigned long ops)
+{
+	unsigned long i;
+
+	if (work_plugin) {
+		if (!td->plugin_ready) {
+			td->plugin_data = work_plugin_data;
+			if (work_plugin->thread_init)
+				td->plugin_data = work_plugin->thread_init(work_plugin_data);
+			td->plugin_ready = 1;
+		}
+		work_plugin->do_work(td->plugin_data, ops);
+		return;
+	}
+	for (i = 0; i < ops; i++)
+		do_some_math(td);
+}
+
+/* called by each thread that does requests on its way out */
+static void plugin_thread_exit(struct thread_data *td)
+{
+	if (td->plugin_ready && work_plugin->thread_exit)
+		work_plugin->thread_exit(td->plugin_data);
+	td->plugin_ready = 0;
+	td->plugin_data = NULL;
+}
+
+/* --work-plugin file[:arg] */
+static void work_plugin_load(void)
+{
+	const struct schbench_plugin *plugin;
+	char *arg;
+
+	arg = strchr(work_plugin_spec, ':');
+	if (arg)
+		*arg++ = '\0';
+	work_plugin_handle = dlopen(work_plugin_spec, RTLD_NOW);
+	if (!work_plugin_handle) {
+		fprintf(stderr, "unable to load %s: %s\n", work_plugin_spec,
+			dlerror());
+		setup_fail();
+	}
+	plugin = dlsym(work_plugin_handle, "schbench_plugin");
+	if (!plugin) {
+		fprintf(stderr, "%s has no schbench_plugin\n", work_plugin_spec);
+		setup_fail();
+	}
+	if (plugin->version != SCHBENCH_PLUGIN_VERSION || !plugin->do_work) {
+		fprintf(stderr, "%s is plugin version %d without do_work, "
+			"we need version %d\n", work_plugin_spec,
+			plugin->version, SCHBENCH_PLUGIN_VERSION);
+		setup_fail();
+	}
+	work_plugin = plugin;
+	if (work_plugin->init)
+		work_plugin_data = work_plugin->init(arg);
+	/* put the spec back together for the manifest */
+	if (arg)
+		arg[-1] = ':';
+	fprintf(stderr, "loaded work plugin %s\n",
+		work_plugin->name ? work_plugin->name : work_plugin_spec);
+}
+
+/*
+ * --lock futex, the classic three state futex mutex.  0 is unlocked,
+ * 1 is locked and 2 is locked with waiters.  Returns 1 if we had to
+ * wait
+ */
+static int shared_futex_lock(int *lock)
+{
+	int c = __sync_val_compare_and_swap(lock, 0, 1);
+
+	if (c == 0)
+		return 0;
+	if (c != 2)
+		c = __sync_lock_test_and_set(lock, 2);
+	while (c != 0) {
+		futex(lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		c = __sync_lock_test_and_set(lock, 2);
+	}
+	return 1;
+}
+
+static void shared_futex_unlock(int *lock)
+{
+	if (__sync_fetch_and_sub(lock, 1) != 1) {
+		__sync_lock_release(lock);
+		futex(lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static void shared_locks_init(void)
+{
+	pthread_mutexattr_t attr;
+	int ret;
+	int i;
+
+	shared_locks = calloc(shared_lock_count, sizeof(struct shared_lock));
+	if (!shared_locks) {
+		perror("unable to allocate shared locks");
+		setup_fail();
+	}
+	pthread_mutexattr_init(&attr);
+	ret = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	if (ret) {
+		fprintf(stderr, "unable to set up PI mutexes: %s\n",
+			strerror(ret));
+		setup_fail();
+	}
+	for (i = 0; i < shared_lock_count; i++) {
+		pthread_mutex_init(&shared_locks[i].mutex, &attr);
+		pthread_rwlock_init(&shared_locks[i].rwlock, NULL);
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * --lock, do ops worth of math while holding one of the shared locks.
+ * We record how long we waited, how long we held it, and when we had
+ * to wait, how long it took from the last unlock until we ran
+ */
+/*
+ * readers unlock in parallel and can stamp out of order, the stamp
+ * only ever moves forward so it's always the most recent unlock
+ */
+static void shared_lock_stamp_release(struct shared_lock *lock,
+				      struct timeval *now)
+{
+	unsigned long long usec = now->tv_sec * USEC_PER_SEC + now->tv_usec;
+	unsigned long long old = lock->release_usec;
+	unsigned long long cur;
+
+	while (old < usec) {
+		cur = __sync_val_compare_and_swap(&lock->release_usec, old, usec);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+static void shared_lock_work(struct thread_data *td, unsigned long ops)
+{
+	unsigned long long release;
+	unsigned long long usec;
+	struct shared_lock *lock;
+	struct timeval start;
+	struct timeval locked;
+	struct timeval now;
+	int read = 0;
+	int contended = 0;
+
+	lock = shared_locks + rand_r(&td->rand_seed) % shared_lock_count;
+	gettimeofday(&start, NULL);
+	switch (shared_lock_type) {
+	case SHARED_LOCK_FUTEX:
+		contended = shared_futex_lock(&lock->futex);
+		break;
+	case SHARED_LOCK_PI:
+		if (pthread_mutex_trylock(&lock->mutex)) {
+			contended = 1;
+			pthread_mutex_lock(&lock->mutex);
+		}
+		break;
+	case SHARED_LOCK_RWLOCK:
+		read = rand_r(&td->rand_seed) % 100 < shared_lock_read_pct;
+		if (read && pthread_rwlock_tryrdlock(&lock->rwlock)) {
+			contended = 1;
+			pthread_rwlock_rdlock(&lock->rwlock);
+		} else if (!read && pthread_rwlock_trywrlock(&lock->rwlock)) {
+			contended = 1;
+			pthread_rwlock_wrlock(&lock->rwlock);
+		}
+		break;
+	}
+	gettimeofday(&locked, NULL);
+	trace_event(td, TRACE_LOCK, td->trace_req, td->kernel_tid);
+
+	td->lock_acquires++;
+	add_lat(&td->lock_wait_stats, tvdelta(&start, &locked));
+	if (contended) {
+		td->lock_contended++;
+		/* nobody has unlocked it yet if there's no stamp */
+		release = __sync_fetch_and_add(&lock->release_usec, 0);
+		usec = locked.tv_sec * USEC_PER_SEC + locked.tv_usec;
+		if (release && usec >= release)
+			add_lat(&td->lock_handoff_stats, usec - release);
+	}
+
+	do_ops(td, ops);
+
+	gettimeofday(&now, NULL);
+	add_lat(&td->lock_hold_stats, tvdelta(&locked, &now));
+	shared_lock_stamp_release(lock, &now);
+	switch (shared_lock_type) {
+	case SHARED_LOCK_FUTEX:
+		shared_futex_unlock(&lock->futex);
+		break;
+	case SHARED_LOCK_PI:
+		pthread_mutex_unlock(&lock->mutex);
+		break;
+	case SHARED_LOCK_RWLOCK:
+		pthread_rwlock_unlock(&lock->rwlock);
+		break;
+	}
+}
+
+static void do_work_ops(struct thread_data *td, unsigned long ops)
+{
+	pthread_mutex_t *lock = NULL;
+	unsigned long shared_ops = 0;
+
+	/* --lock, carve the shared lock's share out of our ops */
+	if (shared_lock_type != SHARED_LOCK_NONE && ops) {
+		shared_ops = ops * shared_lock_pct / 100;
+		if (!shared_ops && shared_lock_pct)
+			shared_ops = 1;
+	}
+
+	/* using --calibrate or --no-locking skips the locks */
+	if (!skip_locking) {
+		lock = lock_this_cpu();
+		trace_event(td, TRACE_LOCK, td->trace_req, td->kernel_tid);
+	}
+	do_ops(td, ops - shared_ops);
+	if (!skip_locking)
+		pthread_mutex_unlock(lock);
+
+	if (shared_ops)
+		shared_lock_work(td, shared_ops);
+}
+
+static void do_work(struct thread_data *td)
+{
+	if (td->stage)
+		do_work_ops(td, stages[td->stage].operations);
+	else if (td->klass)
+		do_work_ops(td, td->klass->operations);
+	else
+		do_work_ops(td, operations);
+}
+
+/* switch the calling thread to a policy or nice level, who is for errors */
+static void apply_sched_policy(struct sched_policy *sched, char *who)
+{
+	if (sched->policy >= 0) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = sched->rt_prio;
+		if (sched_setscheduler(0, sched->policy, &param)) {
+			fprintf(stderr, "unable to set the policy of %s: %s\n",
+				who, strerror(errno));
+			exit(1);
+		}
+	}
+	if (sched->set_nice &&
+	    setpriority(PRIO_PROCESS, syscall(SYS_gettid), sched->nice)) {
+		fprintf(stderr, "unable to set the nice level of %s: %s\n",
+			who, strerror(errno));
+		exit(1);
+	}
+}
+
+/* --class, switch the calling worker to its class's policy or nice */
+static void apply_class_policy(struct thread_data *td)
+{
+	if (td->klass)
+		apply_sched_policy(&td->klass->sched, td->klass->name);
+}
+
+/*
+ * --sleep-type, set up the fds our sleeps need.  Called by each thread
+ * that does simulated sleeps before its first request
+ */
+static void init_sleep_fds(struct thread_data *td)
+{
+	td->timer_fd = -1;
+	td->epoll_fd = -1;
+
+	if (sleep_type == SLEEP_TIMERFD) {
+		td->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (td->timer_fd < 0) {
+			perror("timerfd_create");
+			exit(1);
+		}
+	} else if (sleep_type == SLEEP_EPOLL) {
+		td->epoll_fd = epoll_create1(0);
+		if (td->epoll_fd < 0) {
+			perror("epoll_create1");
+			exit(1);
+		}
+	}
+}
+
+static void close_sleep_fds(struct thread_data *td)
+{
+	if (td->timer_fd >= 0)
+		close(td->timer_fd);
+	if (td->epoll_fd >= 0)
+		close(td->epoll_fd);
+}
+
+/*
+ * the simulated network/disk wait in each request.  We record how far
+ * past the requested time we actually woke up, which is mostly timer
+ * slack and scheduler latency.
+ */
+static void simulated_sleep(struct thread_data *td, unsigned long usec)
+{
+	struct timeval start;
+	struct timeval now;
+	struct timespec ts;
+	struct itimerspec its;
+	struct epoll_event event;
+	unsigned long long expirations;
+	unsigned long long delta;
+	int ret;
+
+	gettimeofday(&start, NULL);
+	switch (sleep_type) {
+	case SLEEP_USLEEP:
+		usleep(usec);
+		break;
+	case SLEEP_NANOSLEEP:
+		ts.tv_sec = usec / USEC_PER_SEC;
+		ts.tv_nsec = (usec % USEC_PER_SEC) * 1000;
+		nanosleep(&ts, NULL);
+		break;
+	case SLEEP_ABSTIME:
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += usec / USEC_PER_SEC;
+		ts.tv_nsec += (usec % USEC_PER_SEC) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		break;
+	case SLEEP_TIMERFD:
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = usec / USEC_PER_SEC;
+		its.it_value.tv_nsec = (usec % USEC_PER_SEC) * 1000;
+		/* a zero it_value would disarm the timer and we'd never wake */
+		if (usec == 0)
+			its.it_value.tv_nsec = 1;
+		if (timerfd_settime(td->timer_fd, 0, &its, NULL) < 0) {
+			perror("timerfd_settime");
+			exit(1);
+		}
+		ret = read(td->timer_fd, &expirations, sizeof(expirations));
+		if (ret < 0 && errno != EINTR) {
+			perror("timerfd read");
+			exit(1);
+		}
+		break;
+	case SLEEP_EPOLL:
+		/* epoll_wait only does milliseconds, round up */
+		epoll_wait(td->epoll_fd, &event, 1, (usec + 999) / 1000);
+		break;
+	}
+	gettimeofday(&now, NULL);
+
+	delta = tvdelta(&start, &now);
+	add_lat(&td->overshoot_stats, delta > usec ? delta - usec : 0);
+}
+
+static void timespec_add_usec(struct timespec *ts, unsigned long usec)
+{
+	ts->tv_sec += usec / USEC_PER_SEC;
+	ts->tv_nsec += (usec % USEC_PER_SEC) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * --periodic, wake up every periodic_period usecs on an absolute timeline
+ * and record how late we were.  If we're so late that whole periods went
+ * by, those are counted as missed and we skip ahead instead of trying to
+ * catch up
+ */
+/* same as stats_reset_check(), for the periodic threads */
+static void periodic_reset_check(struct periodic_thread *pt)
+{
+	unsigned long gen = stats_reset_gen;
+
+	if (pt->reset_gen != gen) {
+		memset(&pt->jitter_stats, 0, sizeof(pt->jitter_stats));
+		pt->missed = 0;
+		pt->reset_gen = gen;
+	}
+}
+
+static void *periodic_thread(void *arg)
+{
+	struct periodic_thread *pt = arg;
+	struct timespec next;
+	struct timespec now;
+	unsigned long long expirations;
+	long long late;
+	int ret;
+
+	apply_sched_policy(&periodic_sched, "periodic threads");
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	timespec_add_usec(&next, periodic_period);
+	if (periodic_timer == PERIODIC_TIMERFD) {
+		struct itimerspec its;
+
+		pt->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (pt->timer_fd < 0) {
+			perror("timerfd_create");
+			exit(1);
+		}
+		its.it_value = next;
+		its.it_interval.tv_sec = periodic_period / USEC_PER_SEC;
+		its.it_interval.tv_nsec = (periodic_period % USEC_PER_SEC) * 1000;
+		if (timerfd_settime(pt->timer_fd, TFD_TIMER_ABSTIME, &its,
+				    NULL) < 0) {
+			perror("timerfd_settime");
+			exit(1);
+		}
+	}
+
+	while (!stopping) {
+		periodic_reset_check(pt);
+		if (periodic_timer == PERIODIC_TIMERFD) {
+			ret = read(pt->timer_fd, &expirations,
+				   sizeof(expirations));
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("timerfd read");
+				exit(1);
+			}
+			/* the timer kept ticking, catch next up to the last one */
+			pt->missed += expirations - 1;
+			while (--expirations)
+				timespec_add_usec(&next, periodic_period);
+		} else {
+			ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					      &next, NULL);
+			if (ret == EINTR)
+				continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		late = (now.tv_sec - next.tv_sec) * USEC_PER_SEC +
+		       (now.tv_nsec - next.tv_nsec) / 1000;
+		add_lat(&pt->jitter_stats, late > 0 ? late : 0);
+
+		timespec_add_usec(&next, periodic_period);
+		if (periodic_timer == PERIODIC_NANOSLEEP) {
+			while (late >= (long long)periodic_period) {
+				timespec_add_usec(&next, periodic_period);
+				late -= periodic_period;
+				pt->missed++;
+			}
+		}
+	}
+	if (periodic_timer == PERIODIC_TIMERFD)
+		close(pt->timer_fd);
+	return NULL;
+}
+
+static void start_periodic_threads(void)
+{
+	int ret;
+	int i;
+
+	periodic_mem = calloc(periodic_threads, sizeof(*periodic_mem));
+	if (!periodic_mem) {
+		perror("unable to allocate periodic threads");
+		exit(1);
+	}
+	for (i = 0; i < periodic_threads; i++) {
+		ret = pthread_create(&periodic_mem[i].tid, NULL, periodic_thread,
+				     periodic_mem + i);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+}
+
+/* called after stopping is set, combines and prints everything */
+static void stop_periodic_threads(void)
+{
+	struct stats jitter_stats;
+	unsigned long long missed = 0;
+	char name[64];
+	int i;
+
+	memset(&jitter_stats, 0, sizeof(jitter_stats));
+	for (i = 0; i < periodic_threads; i++) {
+		pthread_join(periodic_mem[i].tid, NULL);
+		periodic_reset_check(periodic_mem + i);
+		combine_stats(&jitter_stats, &periodic_mem[i].jitter_stats);
+		missed += periodic_mem[i].missed;
+	}
+	free(periodic_mem);
+	periodic_mem = NULL;
+
+	snprintf(name, sizeof(name), "Periodic %luus Wakeup Jitter",
+		 periodic_period);
+	show_latencies(&jitter_stats, name, "usec", runtime, PLIST_FOR_LAT,
+		       PLIST_99);
+	fprintf(stderr, "periodic missed periods: %llu\n", missed);
+}
+
+static void gather_put(struct gather *gather)
+{
+	if (__sync_sub_and_fetch(&gather->refs, 1) == 0)
+		free(gather);
+}
+
+/*
+ * --fanout, run every subtask our siblings have posted to us and let
+ * the parent know when its last one is done
+ */
+static void run_subtasks(struct thread_data *td)
+{
+	struct request *req;
+	struct request *tmp;
+	struct timeval now;
+
+	req = __request_splice(&td->subtasks);
+	while (req) {
+		struct gather *gather = req->gather;
+
+		gettimeofday(&now, NULL);
+		add_lat(&td->subtask_stats, tvdelta(&req->start_time, &now));
+		do_work(td);
+
+		if (__sync_sub_and_fetch(&gather->remaining, 1) == 0)
+			fpost(&gather->parent->futex);
+		gather_put(gather);
+
+		tmp = req->next;
+		free(req);
+		req = tmp;
+	}
+}
+
+/*
+ * --fanout, scatter subtasks to distinct siblings, do our own share of
+ * the work and then wait for all of them to finish.  While we wait we
+ * keep running subtasks other workers send us, otherwise a group full
+ * of parents waiting on each other would deadlock.
+ */
+static void fanout_request(struct thread_data *td, unsigned long ops)
+{
+	struct thread_data *siblings = td->msg_thread + 1;
+	struct gather *gather;
+	struct timeval now;
+	int me = td - siblings;
+	int nr = fanout;
+	int first;
+	int i;
+
+	if (fanout_random)
+		nr = 1 + rand_r(&td->rand_seed) % fanout;
+
+	gather = malloc(sizeof(*gather));
+	if (!gather) {
+		perror("malloc");
+		exit(1);
+	}
+	gather->remaining = nr;
+	gather->refs = nr + 1;
+	gather->parent = td;
+	gettimeofday(&gather->start, NULL);
+
+	first = rand_r(&td->rand_seed) % (worker_threads - 1);
+	for (i = 0; i < nr; i++) {
+		int off = 1 + (first + i) % (worker_threads - 1);
+		struct thread_data *target = siblings + (me + off) % worker_threads;
+		struct request *sub = allocate_request();
+
+		sub->gather = gather;
+		__request_add(&target->subtasks, sub);
+		fpost(&target->futex);
+	}
+
+	do_work_ops(td, ops);
+
+	while (1) {
+		td->futex = FUTEX_BLOCKED;
+		run_subtasks(td);
+		/* the siblings are gone if we're stopping */
+		if (gather->remaining == 0 || stopping)
+			break;
+		fwait(&td->futex, NULL, &td->spin);
+	}
+	td->futex = FUTEX_RUNNING;
+
+	if (gather->remaining == 0) {
+		gettimeofday(&now, NULL);
+		add_lat(&td->gather_stats, tvdelta(&gather->start, &now));
+	}
+	gather_put(gather);
+}
+
+/*
+ * --request-template, pick how long a sleep phase sleeps
+ */
+static unsigned long phase_sleep_usec(struct thread_data *td,
+				      struct request_phase *phase)
+{
+	double u;
+
+	switch (phase->type) {
+	case PHASE_SLEEP_UNIFORM:
+		return phase->a + rand_r(&td->rand_seed) % (phase->b - phase->a + 1);
+	case PHASE_SLEEP_EXP:
+		/* u is in (0, 1] so the log is always defined */
+		u = (rand_r(&td->rand_seed) + 1.0) / ((double)RAND_MAX + 1.0);
+		return -log(u) * phase->a;
+	}
+	return phase->a;
+}
+
+#define THP_SIZE (2UL * 1024 * 1024)
+
+/*
+ * --request-template memory phase.  Map kb of anonymous memory, write
+ * every page and throw it away again.  Every request takes the mmap
+ * lock and faults in fresh pages, and the munmap or MADV_DONTNEED
+ * sends TLB shootdowns to every cpu that ran one of our threads.
+ */
+static void mem_phase(struct thread_data *td, unsigned long kb)
+{
+	static long page_size;
+	size_t size = kb * 1024;
+	size_t map_size = size;
+	struct timeval start;
+	struct timeval now;
+	struct rusage before;
+	struct rusage after;
+	char *map;
+	char *buf;
+	size_t off;
+
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	gettimeofday(&start, NULL);
+	getrusage(RUSAGE_THREAD, &before);
+
+	if (mem_mode == MEM_DONTNEED && td->mem_buf_size < size) {
+		if (td->mem_buf)
+			munmap(td->mem_buf, td->mem_buf_size);
+		td->mem_buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (td->mem_buf == MAP_FAILED) {
+			perror("unable to map memory phase");
+			exit(1);
+		}
+		td->mem_buf_size = size;
+	}
+
+	if (mem_mode == MEM_DONTNEED) {
+		map = buf = td->mem_buf;
+	} else {
+		/* room to line the buffer up on a huge page */
+		if (mem_mode == MEM_THP)
+			map_size += THP_SIZE;
+		map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			perror("unable to map memory phase");
+			exit(1);
+		}
+		buf = map;
+		if (mem_mode == MEM_THP) {
+			buf = (char *)(((unsigned long)map + THP_SIZE - 1) &
+				       ~(THP_SIZE - 1));
+			madvise(buf, size, MADV_HUGEPAGE);
+		}
+	}
+
+	for (off = 0; off < size; off += page_size)
+		buf[off] = off;
+
+	if (mem_mode == MEM_DONTNEED)
+		madvise(buf, size, MADV_DONTNEED);
+	else
+		munmap(map, map_size);
+
+	getrusage(RUSAGE_THREAD, &after);
+	gettimeofday(&now, NULL);
+	add_lat(&td->mem_stats, tvdelta(&start, &now));
+	add_lat(&td->mem_fault_stats, (after.ru_minflt - before.ru_minflt) +
+		(after.ru_majflt - before.ru_majflt));
+}
+
+/*
+ * --request-template, run each phase of the request in order.  With
+ * --fanout the first compute phase is where we scatter and gather.
+ * Calibration mode skips the sleeps so only the math is timed.
+ */
+static void run_request_template(struct thread_data *td)
+{
+	struct request_phase *phase;
+	int scattered = 0;
+	int i;
+
+	for (i = 0; i < nr_request_phases; i++) {
+		phase = &request_phases[i];
+		if (phase->type == PHASE_COMPUTE) {
+			if (fanout && !scattered) {
+				fanout_request(td, phase->a);
+				scattered = 1;
+			} else {
+				do_work_ops(td, phase->a);
+			}
+		} else if (phase->type == PHASE_MEMORY) {
+			mem_phase(td, phase->a);
+		} else if (!calibrate_only) {
+			simulated_sleep(td, phase_sleep_usec(td, phase));
+		}
+	}
+}
+
+/*
+ * --pipeline, index of the first worker for a given stage in the
+ * message thread's stage_threads array
+ */
+static int stage_offset(int stage)
+{
+	int offset = 0;
+	int i;
+
+	for (i = 1; i < stage; i++)
+		offset += stages[i].threads;
+	return offset;
+}
+
+/*
+ * --pipeline, pass a finished request on to a worker in the next stage
+ * using the same list and futex dance the rps thread uses.  Once the
+ * last stage is done we record the end to end latency and free it.
+ */
+static void pipeline_forward(struct thread_data *td, struct request *req)
+{
+	struct thread_data *target;
+	struct thread_data *pool;
+	int next = td->stage + 1;
+
+	if (next >= nr_stages) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		add_lat(&td->pipeline_stats, tvdelta(&req->start_time, &now));
+		free(req);
+		return;
+	}
+
+	pool = td->msg_thread->stage_threads + stage_offset(next);
+	target = pool + td->stage_rr++ % stages[next].threads;
+
+	gettimeofday(&req->hop_time, NULL);
+	request_add(target, req);
+	memcpy(&target->wake_time, &req->hop_time, sizeof(req->hop_time));
+	fpost(&target->futex);
+}
+
+/*
+ * --pipeline, workers for stages 1 and up.  They sleep until the stage
+ * before them hands over some requests, run each one through this
+ * stage's work model and pass it along.
+ */
+static void *stage_worker_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct stage_config *stage = &stages[td->stage];
+	struct request *req;
+	struct request *tmp;
+	struct timeval work_start;
+	struct timeval now;
+	struct timeval start;
+
+	init_sleep_fds(td);
+	trace_init(td);
+	gettimeofday(&start, NULL);
+	while (1) {
+		stats_reset_check(td);
+		td->futex = FUTEX_BLOCKED;
+		req = request_splice(td);
+		if (!req) {
+			if (td->stage_exit)
+				break;
+			fwait(&td->futex, NULL, &td->spin);
+			stats_reset_check(td);
+			if (!stopping) {
+				gettimeofday(&now, NULL);
+				add_lat(&td->wakeup_stats[0],
+					tvdelta(&td->wake_time, &now));
+			}
+			continue;
+		}
+		td->futex = FUTEX_RUNNING;
+
+		while (req) {
+			gettimeofday(&work_start, NULL);
+			add_lat(&td->queue_stats,
+				tvdelta(&req->hop_time, &work_start));
+
+			if (stage->sleep_usec)
+				simulated_sleep(td, stage->sleep_usec);
+			do_work(td);
+
+			tmp = req->next;
+			pipeline_forward(td, req);
+			req = tmp;
+
+			gettimeofday(&now, NULL);
+			add_lat(&td->request_stats[0], tvdelta(&work_start, &now));
+			td->loop_count++;
+		}
+	}
+	gettimeofday(&now, NULL);
+	td->runtime = tvdelta(&start, &now);
+	close_sleep_fds(td);
+	plugin_thread_exit(td);
+	return NULL;
+}
+
+/*
+ * --fibers, each worker multiplexes this many user level threads.  A
+ * fiber runs one request at a time, and instead of blocking in the
+ * kernel for the simulated network wait it switches back to the
+ * worker's scheduler loop so another fiber can run.  The kernel only
+ * sees the worker block when no fiber has anything to do
+ */
+enum {
+	FIBER_IDLE,
+	FIBER_READY,
+	FIBER_SLEEPING,
+};
+
+struct fiber {
+	ucontext_t ctx;
+	struct thread_data *td;
+	struct request *req;
+	/* when a sleeping fiber's simulated wait is over */
+	struct timeval wake_at;
+	int state;
+	void *stack;
+};
+
+/* makecontext only passes ints, so new fibers find themselves here */
+static __thread struct fiber *current_fiber;
+
+/* the fiber version of simulated_sleep(), yield until usec has passed */
+static void fiber_sleep(struct fiber *f, unsigned long usec)
+{
+	struct timeval now;
+
+	gettimeofday(&f->wake_at, NULL);
+	f->wake_at.tv_usec += usec;
+	while (f->wake_at.tv_usec >= USEC_PER_SEC) {
+		f->wake_at.tv_sec++;
+		f->wake_at.tv_usec -= USEC_PER_SEC;
+	}
+	f->state = FIBER_SLEEPING;
+	swapcontext(&f->ctx, &f->td->fiber_sched_ctx);
+
+	gettimeofday(&now, NULL);
+	add_lat(&f->td->overshoot_stats, tvdelta(&f->wake_at, &now));
+}
+
+static void fiber_main(void)
+{
+	struct fiber *f = current_fiber;
+	struct thread_data *td = f->td;
+	struct timeval work_start;
+	struct timeval now;
+	unsigned long long delta;
+
+	while (1) {
+		gettimeofday(&work_start, NULL);
+		add_lat(&td->fiber_dispatch_stats,
+			tvdelta(&f->req->start_time, &work_start));
+		trace_event(td, TRACE_ON_CPU, f->req->id, td->kernel_tid);
+		fiber_sleep(f, 100);
+		do_work(td);
+
+		gettimeofday(&now, NULL);
+		trace_event(td, TRACE_WORK_DONE, f->req->id, td->kernel_tid);
+		delta = tvdelta(&work_start, &now);
+		if (delta > 0) {
+			add_thread_lat(td, td->request_stats, delta);
+			llc_add_lat(td, 1, delta);
+			if (td->klass)
+				add_lat(&td->class_request_stats, delta);
+		}
+		add_lat(&td->fiber_request_stats,
+			tvdelta(&f->req->start_time, &now));
+		td->loop_count++;
+
+		free(f->req);
+		f->req = NULL;
+		f->state = FIBER_IDLE;
+		swapcontext(&f->ctx, &td->fiber_sched_ctx);
+	}
+}
+
+static void fibers_init(struct thread_data *td)
+{
+	struct fiber *f;
+	int i;
+
+	td->fibers = calloc(fibers, sizeof(struct fiber));
+	if (!td->fibers) {
+		perror("unable to allocate fibers");
+		exit(1);
+	}
+	for (i = 0; i < fibers; i++) {
+		f = td->fibers + i;
+		f->td = td;
+		f->stack = malloc(FIBER_STACK_SIZE);
+		if (!f->stack) {
+			perror("unable to allocate fiber stack");
+			exit(1);
+		}
+		getcontext(&f->ctx);
+		f->ctx.uc_stack.ss_sp = f->stack;
+		f->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+		f->ctx.uc_link = NULL;
+		makecontext(&f->ctx, fiber_main, 0);
+	}
+}
+
+static void fibers_free(struct thread_data *td)
+{
+	struct request *req;
+	int i;
+
+	for (i = 0; i < fibers; i++) {
+		free(td->fibers[i].req);
+		free(td->fibers[i].stack);
+	}
+	free(td->fibers);
+	td->fibers = NULL;
+
+	while (td->fiber_queue) {
+		req = td->fiber_queue;
+		td->fiber_queue = req->next;
+		free(req);
+	}
+	td->fiber_queue_tail = NULL;
+}
+
+/*
+ * move newly posted requests onto our fifo.  We leave them on the
+ * lock free list while the fifo has work, so the rps thread's
+ * pending limit still holds when every fiber is busy
+ */
+static void fiber_queue_requests(struct thread_data *td)
+{
+	struct request *req;
+
+	if (td->fiber_queue)
+		return;
+	td->pending = 0;
+	req = request_splice(td);
+	if (!req)
+		return;
+	td->fiber_queue = req;
+	while (req->next)
+		req = req->next;
+	td->fiber_queue_tail = req;
+}
+
+/* the worker's scheduler loop, runs until we're stopping */
+static void run_fibers(struct thread_data *td)
+{
+	struct timeval now;
+	struct timeval earliest;
+	struct timespec timeout;
+	struct fiber *f;
+	unsigned long long delta;
+	int sleeping;
+	int ran;
+	int ret;
+	int i;
+
+	fibers_init(td);
+	while (!stopping) {
+		stats_reset_check(td);
+		fiber_queue_requests(td);
+		gettimeofday(&now, NULL);
+		sleeping = 0;
+		ran = 0;
+		for (i = 0; i < fibers; i++) {
+			f = td->fibers + i;
+			if (f->state == FIBER_IDLE && td->fiber_queue) {
+				f->req = td->fiber_queue;
+				td->fiber_queue = f->req->next;
+				f->req->next = NULL;
+				f->state = FIBER_READY;
+			} else if (f->state == FIBER_SLEEPING &&
+				   !timercmp(&now, &f->wake_at, <)) {
+				f->state = FIBER_READY;
+			}
+			if (f->state == FIBER_READY) {
+				current_fiber = f;
+				swapcontext(&td->fiber_sched_ctx, &f->ctx);
+				td->fiber_switches++;
+				ran = 1;
+			}
+			if (f->state == FIBER_SLEEPING &&
+			    (!sleeping || timercmp(&f->wake_at, &earliest, <))) {
+				earliest = f->wake_at;
+				sleeping = 1;
+			}
+		}
+		if (ran)
+			continue;
+
+		/*
+		 * nothing to run, block until we're posted or the first
+		 * sleeping fiber is due.  Same handshake as msg_and_wait()
+		 */
+		td->futex = FUTEX_BLOCKED;
+		gettimeofday(&td->wake_time, NULL);
+		if (td->request || stopping) {
+			td->futex = FUTEX_RUNNING;
+			continue;
+		}
+		if (sleeping) {
+			delta = tvdelta(&td->wake_time, &earliest);
+			timeout.tv_sec = delta / USEC_PER_SEC;
+			timeout.tv_nsec = (delta % USEC_PER_SEC) * 1000;
+			ret = fwait(&td->futex, &timeout, &td->spin);
+		} else {
+			ret = fwait(&td->futex, NULL, &td->spin);
+		}
+		if (ret == 0) {
+			gettimeofday(&now, NULL);
+			delta = tvdelta(&td->wake_time, &now);
+			if (delta > 0)
+				record_wakeup(td, delta);
+		}
+		td->futex = FUTEX_RUNNING;
+	}
+	fibers_free(td);
+}
+
+static void combine_lock_stats(struct thread_data *thread_data,
+			       struct stats *wait, struct stats *hold,
+			       struct stats *handoff,
+			       unsigned long long *acquires,
+			       unsigned long long *contended)
+{
+	struct thread_data *td;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*acquires = 0;
+	*contended = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			td = thread_data + index++;
+			combine_stats(wait, &td->lock_wait_stats);
+			combine_stats(hold, &td->lock_hold_stats);
+			combine_stats(handoff, &td->lock_handoff_stats);
+			*acquires += td->lock_acquires;
+			*contended += td->lock_contended;
+		}
+		/* pipeline stages do requests too */
+		for (i = 0; nr_stages > 1 && i < stage_offset(nr_stages); i++) {
+			td = thread_data[index - worker_threads - 1].stage_threads + i;
+			combine_stats(wait, &td->lock_wait_stats);
+			combine_stats(hold, &td->lock_hold_stats);
+			combine_stats(handoff, &td->lock_handoff_stats);
+			*acquires += td->lock_acquires;
+			*contended += td->lock_contended;
+		}
+	}
+}
+
+static void combine_fiber_stats(struct thread_data *thread_data,
+				struct stats *dispatch, struct stats *request,
+				unsigned long long *switches)
+{
+	struct thread_data *td;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*switches = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			td = thread_data + index++;
+			combine_stats(dispatch, &td->fiber_dispatch_stats);
+			combine_stats(request, &td->fiber_request_stats);
+			*switches += td->fiber_switches;
+		}
+	}
+}
+
+/*
+ * the worker thread is pretty simple, it just does a single spin and
+ * then waits on a message from the message thread
+ */
+static void *worker_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct timeval now;
+	struct timeval work_start;
+	struct timeval start;
+	unsigned long long delta;
+	/* runtime of the workers we replaced, if we were churned in */
+	unsigned long long prev_runtime = td->runtime;
+	struct request *req = NULL;
+
+	gettimeofday(&start, NULL);
+	if (td->churn_spawn_time.tv_sec) {
+		stats_reset_check(td);
+		delta = tvdelta(&td->churn_spawn_time, &start);
+		add_lat(&td->churn_first_run_stats, delta);
+		td->churn_young = CHURN_YOUNG_WAKEUPS;
+	}
+	layout_apply(td);
+	apply_class_policy(td);
+	llc_stats_init(td);
+	init_sleep_fds(td);
+	trace_init(td);
+	perf_init(td);
+	while(1) {
+		if (stopping || td->churn_exit)
+			break;
+		if (fibers) {
+			run_fibers(td);
+			break;
+		}
+
+		stats_reset_check(td);
+		req = msg_and_wait(td);
+		if (requests_per_sec && !req)
+			continue;
+
+		do {
+			struct request *tmp;
+
+			if (req)
+				td->trace_req = req->id;
+			trace_event(td, TRACE_ON_CPU, td->trace_req, td->kernel_tid);
+			perf_request_start(td);
+
+			if (pipe_test) {
+				gettimeofday(&work_start, NULL);
+			} else if (nr_request_phases) {
+				gettimeofday(&work_start, NULL);
+				run_request_template(td);
+			} else {
+				if (calibrate_only) {
+					/*
+					 * in calibration mode, don't include the
+					 * usleep in the timing
+					 */
+					simulated_sleep(td, 100);
+					gettimeofday(&work_start, NULL);
+				} else {
+					/*
+					 * lets start off with some simulated networking,
+					 * and also make sure we get a fresh clean timeslice
+					 */
+					gettimeofday(&work_start, NULL);
+					simulated_sleep(td, 100);
+				}
+				if (fanout)
+					fanout_request(td, operations);
+				else
+					do_work(td);
+			}
+
+			gettimeofday(&now, NULL);
+			trace_event(td, TRACE_WORK_DONE, td->trace_req, td->kernel_tid);
+			perf_request_done(td);
+
+			td->runtime = prev_runtime + tvdelta(&start, &now);
+			if (req && work_steal) {
+				delta = tvdelta(&req->start_time, &now);
+				if (req->stolen)
+					add_lat(&td->stolen_stats, delta);
+				else
+					add_lat(&td->local_stats, delta);
+			}
+			if (req) {
+				tmp = req->next;
+				if (nr_stages > 1)
+					pipeline_forward(td, req);
+				else
+					free(req);
+				req = tmp;
+			} else if (nr_stages > 1) {
+				/* start the clock when the message thread woke us */
+				tmp = allocate_request();
+				memcpy(&tmp->start_time, &td->wake_time,
+				       sizeof(td->wake_time));
+				pipeline_forward(td, tmp);
+			}
+			td->loop_count++;
+
+			delta = tvdelta(&work_start, &now);
+			if (delta > 0) {
+				add_thread_lat(td, td->request_stats, delta);
+				llc_add_lat(td, 1, delta);
+				if (td->klass)
+					add_lat(&td->class_request_stats, delta);
+			}
+		} while (req);
+	}
+	gettimeofday(&now, NULL);
+	td->runtime = prev_runtime + tvdelta(&start, &now);
+	close_sleep_fds(td);
+	plugin_thread_exit(td);
+	if (td->mem_buf) {
+		munmap(td->mem_buf, td->mem_buf_size);
+		td->mem_buf = NULL;
+		td->mem_buf_size = 0;
+	}
+	if (td->perf_fd >= 0)
+		close(td->perf_fd);
+
+	return NULL;
+}
+
+/* ask a worker to exit and wait for it.  Returns once it's gone */
+static void churn_retire(struct thread_data *worker)
+{
+	/* an idle worker is parked in fwait, kick it so it sees churn_exit */
+	worker->churn_exit = 1;
+	fpost(&worker->futex);
+	pthread_join(worker->tid, NULL);
+	worker->churn_exited = 1;
+	worker->churn_exit = 0;
+}
+
+/*
+ * the churn thread's version of stats_reset_check().  It records into
+ * the message thread's thread_data, which nothing else resets
+ */
+static void churn_reset_check(struct thread_data *td)
+{
+	unsigned long gen = stats_reset_gen;
+
+	if (td->reset_gen != gen) {
+		memset(&td->churn_create_stats, 0, sizeof(td->churn_create_stats));
+		td->churn_replaced = 0;
+		td->reset_gen = gen;
+	}
+}
+
+/* start a new worker on a retired worker's thread_data */
+static void churn_spawn(struct thread_data *td, struct thread_data *worker)
+{
+	struct timeval now;
+	pthread_t tid;
+	int ret;
+
+	gettimeofday(&worker->churn_spawn_time, NULL);
+	ret = pthread_create(&tid, NULL, worker_thread, worker);
+	if (ret) {
+		fprintf(stderr, "error %d from pthread_create\n", ret);
+		exit(1);
+	}
+	gettimeofday(&now, NULL);
+	add_lat(&td->churn_create_stats,
+		tvdelta(&worker->churn_spawn_time, &now));
+	worker->tid = tid;
+	worker->churn_exited = 0;
+	td->churn_replaced++;
+}
+
+/*
+ * --churn-ramp, stop sending rps requests to a worker and retire it.
+ * Anything that was already queued moves to worker 0, which never
+ * parks.  A request that raced in after the splice waits for the
+ * worker to come back
+ */
+static void churn_park(struct thread_data *worker_threads_mem, int slot)
+{
+	struct thread_data *worker = worker_threads_mem + slot;
+	struct request *req;
+
+	worker->churn_parked = 1;
+	__sync_synchronize();
+	churn_retire(worker);
+
+	req = request_splice(worker);
+	while (req) {
+		struct request *next = req->next;
+
+		request_add(worker_threads_mem, req);
+		req = next;
+	}
+	fpost(&worker_threads_mem->futex);
+}
+
+/*
+ * one of these runs next to each message thread when churn is on.
+ * --churn-pct replaces a slice of the workers every interval, round
+ * robin.  --churn-ramp walks the number of live workers from -t down
+ * to one and back up in a triangle wave
+ */
+static void *churn_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct thread_data *worker_threads_mem = td + 1;
+	struct timeval start;
+	struct timeval now;
+	int active = worker_threads;
+	int cursor = 0;
+	int i;
+
+	gettimeofday(&start, NULL);
+	while (!stopping) {
+		usleep(churn_interval * 1000);
+		if (stopping)
+			break;
+		churn_reset_check(td);
+
+		if (churn_pct) {
+			int nr = worker_threads * churn_pct / 100;
+
+			if (nr < 1)
+				nr = 1;
+			for (i = 0; i < nr && !stopping; i++) {
+				struct thread_data *worker;
+
+				/* with a ramp running, only churn live workers */
+				worker = worker_threads_mem + cursor++ % active;
+				churn_retire(worker);
+				if (!stopping)
+					churn_spawn(td, worker);
+			}
+		}
+		if (churn_ramp) {
+			unsigned long long period = churn_ramp * USEC_PER_SEC;
+			unsigned long long pos;
+			int target;
+
+			gettimeofday(&now, NULL);
+			pos = tvdelta(&start, &now) % period;
+			if (pos > period / 2)
+				pos = period - pos;
+			target = worker_threads - (worker_threads - 1) * pos * 2 / period;
+
+			while (active > target && !stopping) {
+				active--;
+				churn_park(worker_threads_mem, active);
+			}
+			while (active < target && !stopping) {
+				struct thread_data *worker = worker_threads_mem + active;
+
+				churn_spawn(td, worker);
+				worker->churn_parked = 0;
+				active++;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void combine_churn_stats(struct thread_data *thread_data,
+				struct stats *create, struct stats *first_run,
+				struct stats *young, unsigned long long *replaced)
+{
+	struct thread_data *td;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*replaced = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		td = thread_data + index++;
+		combine_stats(create, &td->churn_create_stats);
+		*replaced += td->churn_replaced;
+		for (i = 0; i < worker_threads; i++) {
+			td = thread_data + index++;
+			combine_stats(first_run, &td->churn_first_run_stats);
+			combine_stats(young, &td->churn_young_stats);
+		}
+	}
+}
+
+/*
+ * the message thread starts his own gaggle of workers and then sits around
+ * replying when they post him.  He collects latency stats as all the threads
+ * exit
+ */
+static void *message_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct thread_data *worker_threads_mem = NULL;
+	int i;
+	int ret;
+
+	worker_threads_mem = td + 1;
+
+	if (!worker_threads_mem) {
+		perror("unable to allocate ram");
+		pthread_exit((void *)-ENOMEM);
+	}
+
+	layout_apply(td);
+	trace_init(td);
+	td->home_cpu = sched_getcpu();
+	pthread_barrier_wait(&home_barrier);
+
+	if (nr_stages > 1) {
+		int nr = stage_offset(nr_stages);
+		int stage = 1;
+		int left = stages[1].threads;
+
+		td->stage_threads = calloc(nr, sizeof(struct thread_data));
+		if (!td->stage_threads) {
+			perror("unable to allocate ram");
+			pthread_exit((void *)-ENOMEM);
+		}
+		for (i = 0; i < nr; i++) {
+			struct thread_data *stage_td = td->stage_threads + i;
+			pthread_t tid;
+
+			if (left == 0) {
+				stage++;
+				left = stages[stage].threads;
+			}
+			left--;
+
+			stage_td->stage = stage;
+			stage_td->msg_thread = td;
+			stage_td->cpus = td->cpus;
+			stage_td->rand_seed = mix_seed(td->rand_seed, worker_threads + i);
+			stage_td->data = alloc_buffer(matrix_bytes());
+			if (!stage_td->data) {
+				perror("unable to allocate ram");
+				pthread_exit((void *)-ENOMEM);
+			}
+			ret = pthread_create(&tid, NULL, stage_worker_thread,
+					     stage_td);
+			if (ret) {
+				fprintf(stderr, "error %d from pthread_create\n", ret);
+				exit(1);
+			}
+			stage_td->tid = tid;
+		}
+	}
+
+	for (i = 0; i < worker_threads; i++) {
+		pthread_t tid;
+		worker_threads_mem[i].data = alloc_buffer(matrix_bytes());
+		if (!worker_threads_mem[i].data) {
+			perror("unable to allocate ram");
+			pthread_exit((void *)-ENOMEM);
+		}
+
+		worker_threads_mem[i].msg_thread = td;
+		worker_threads_mem[i].cpus = td->cpus;
+		worker_threads_mem[i].rand_seed = mix_seed(td->rand_seed, i);
+		ret = pthread_create(&tid, NULL, worker_thread,
+				     worker_threads_mem + i);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+		worker_threads_mem[i].tid = tid;
+	}
+
+	/* don't post anyone until we know their tids for the trace */
+	for (i = 0; trace_file && i < worker_threads; i++) {
+		while (!worker_threads_mem[i].kernel_tid)
+			usleep(100);
+	}
+
+	if (churn_pct || churn_ramp) {
+		ret = pthread_create(&td->churn_tid, NULL, churn_thread, td);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+
+	if (requests_per_sec)
+		run_rps_thread(worker_threads_mem);
+	else
+		run_msg_thread(td);
+
+	/* the churn thread joins workers too, let it finish first */
+	if (churn_pct || churn_ramp) {
+		pthread_join(td->churn_tid, NULL);
+		churn_reset_check(td);
+	}
+
+	for (i = 0; i < worker_threads; i++) {
+		if (worker_threads_mem[i].churn_exited)
+			continue;
+		fpost(&worker_threads_mem[i].futex);
+		pthread_join(worker_threads_mem[i].tid, NULL);
+	}
+
+	/*
+	 * stage threads are laid out in stage order.  By the time we tell
+	 * a stage to exit everything upstream of it has been joined, so its
+	 * list holds the last requests it will ever get.  It drains them
+	 * into a stage that is still running and then exits
+	 */
+	for (i = 0; nr_stages > 1 && i < stage_offset(nr_stages); i++) {
+		td->stage_threads[i].stage_exit = 1;
+		fpost(&td->stage_threads[i].futex);
+		pthread_join(td->stage_threads[i].tid, NULL);
+	}
+
+	for (i = 0; i < worker_threads; i++) {
+		free_buffer(worker_threads_mem[i].data, matrix_bytes());
+		worker_threads_mem[i].data = NULL;
+	}
+	for (i = 0; nr_stages > 1 && i < stage_offset(nr_stages); i++) {
+		free_buffer(td->stage_threads[i].data, matrix_bytes());
+		td->stage_threads[i].data = NULL;
+	}
+	return NULL;
+}
+
+static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
+
+static double pretty_size(double number, char **str)
+{
+	int divs = 0;
+
+	while(number >= 1024) {
+		if (units[divs + 1] == NULL)
+			break;
+		divs++;
+		number /= 1024;
+	}
+	*str = units[divs];
+	return number;
+}
+
+/*
+ * we want to calculate RPS more often than the full message stats,
+ * so this is a less expensive walk through all the message threads
+ * to pull that out
+ */
+static void combine_message_thread_rps(struct thread_data *thread_data,
+				       unsigned long long *loop_count)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*loop_count = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			*loop_count += worker->loop_count;
+		}
+	}
+}
+
+/*
+ * flip the stats epoch and fold every worker's now quiescent buffer
+ * into the totals.  Empty buffers are skipped entirely, which keeps
+ * this cheap with thousands of mostly idle workers
+ */
+static void __flip_thread_stats(struct thread_data *thread_data,
+				struct stats *tick_wakeup,
+				struct stats *tick_request)
+{
+	struct thread_data *worker;
+	unsigned long old = stats_epoch;
+	unsigned long spins;
+	struct stats *s;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	stats_epoch = old + 1;
+	__sync_synchronize();
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+
+			/* wait for anyone who saw the old epoch to finish */
+			for (spins = 1; worker->stats_busy; spins++) {
+				if ((spins & 1023) == 0)
+					sched_yield();
+				else
+					nop;
+			}
+
+			s = &worker->wakeup_stats[old & 1];
+			if (s->nr_samples) {
+				combine_stats(&total_wakeup_stats, s);
+				if (tick_wakeup)
+					combine_stats(tick_wakeup, s);
+				memset(s, 0, sizeof(*s));
+			}
+			s = &worker->request_stats[old & 1];
+			if (s->nr_samples) {
+				combine_stats(&total_request_stats, s);
+				if (tick_request)
+					combine_stats(tick_request, s);
+				memset(s, 0, sizeof(*s));
+			}
+		}
+	}
+}
+
+static void flip_thread_stats(struct thread_data *thread_data,
+			      struct stats *tick_wakeup,
+			      struct stats *tick_request)
+{
+	pthread_mutex_lock(&stats_lock);
+	__flip_thread_stats(thread_data, tick_wakeup, tick_request);
+	if (tick_wakeup) {
+		combine_stats(tick_wakeup, &snap_wakeup_stats);
+		memset(&snap_wakeup_stats, 0, sizeof(snap_wakeup_stats));
+	}
+	if (tick_request) {
+		combine_stats(tick_request, &snap_request_stats);
+		memset(&snap_request_stats, 0, sizeof(snap_request_stats));
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * pass flip == 0 if the caller just flipped the stats itself and
+ * wants the totals as of that flip
+ */
+static void combine_message_thread_stats(struct stats *wakeup_stats,
+					 struct stats *request_stats,
+					struct thread_data *thread_data,
+					unsigned long long *loop_count,
+					unsigned long long *loop_runtime,
+					int flip)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	if (flip)
+		flip_thread_stats(thread_data, NULL, NULL);
+	combine_stats(wakeup_stats, &total_wakeup_stats);
+	combine_stats(request_stats, &total_request_stats);
+
+	*loop_count = 0;
+	*loop_runtime = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			*loop_count += worker->loop_count;
+			*loop_runtime += worker->runtime;
+		}
+	}
+}
+
+/*
+ * --steal, fold the local vs stolen request latencies and the steal
+ * counters from all the workers
+ */
+static void combine_steal_stats(struct stats *local_stats,
+				struct stats *stolen_stats,
+				struct thread_data *thread_data,
+				unsigned long long *steals,
+				unsigned long long *failed_steals)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*steals = 0;
+	*failed_steals = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(local_stats, &worker->local_stats);
+			combine_stats(stolen_stats, &worker->stolen_stats);
+			*steals += worker->steals;
+			*failed_steals += worker->failed_steals;
+		}
+	}
+}
+
+/*
+ * --spin, sum up the spin accounting from the message threads and
+ * all of their workers
+ */
+static void combine_spin_stats(struct spin_state *total,
+			       struct thread_data *thread_data)
+{
+	struct thread_data *td;
+	int i;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < message_threads * worker_threads + message_threads; i++) {
+		td = thread_data + i;
+		total->spin_wakes += td->spin.spin_wakes;
+		total->sleep_wakes += td->spin.sleep_wakes;
+		total->spin_time += td->spin.spin_time;
+	}
+	for (i = 0; nr_stages > 1 && i < message_threads; i++) {
+		struct thread_data *msg = thread_data + i * worker_threads + i;
+		int j;
+
+		for (j = 0; j < stage_offset(nr_stages); j++) {
+			td = msg->stage_threads + j;
+			total->spin_wakes += td->spin.spin_wakes;
+			total->sleep_wakes += td->spin.sleep_wakes;
+			total->spin_time += td->spin.spin_time;
+		}
+	}
+}
+
+/*
+ * --pipeline, print wakeup, queueing and service latencies for each
+ * stage after the first, and the end to end latency from the last one
+ */
+static void show_pipeline_stats(struct thread_data *thread_data)
+{
+	struct stats wakeup_stats;
+	struct stats queue_stats;
+	struct stats request_stats;
+	struct stats pipeline_stats;
+	char label[64];
+	int stage;
+	int i;
+	int j;
+
+	memset(&pipeline_stats, 0, sizeof(pipeline_stats));
+	for (stage = 1; stage < nr_stages; stage++) {
+		int offset = stage_offset(stage);
+
+		memset(&wakeup_stats, 0, sizeof(wakeup_stats));
+		memset(&queue_stats, 0, sizeof(queue_stats));
+		memset(&request_stats, 0, sizeof(request_stats));
+		for (i = 0; i < message_threads; i++) {
+			struct thread_data *msg = thread_data + i * worker_threads + i;
+
+			for (j = 0; j < stages[stage].threads; j++) {
+				struct thread_data *td = msg->stage_threads + offset + j;
+
+				combine_stats(&wakeup_stats, &td->wakeup_stats[0]);
+				combine_stats(&queue_stats, &td->queue_stats);
+				combine_stats(&request_stats, &td->request_stats[0]);
+				combine_stats(&pipeline_stats, &td->pipeline_stats);
+			}
+		}
+		snprintf(label, sizeof(label), "Stage %d Wakeup Latencies", stage);
+		show_latencies(&wakeup_stats, label, "usec", runtime,
+			       PLIST_FOR_LAT, PLIST_99);
+		snprintf(label, sizeof(label), "Stage %d Queue Latencies", stage);
+		show_latencies(&queue_stats, label, "usec", runtime,
+			       PLIST_FOR_LAT, PLIST_99);
+		snprintf(label, sizeof(label), "Stage %d Request Latencies", stage);
+		show_latencies(&request_stats, label, "usec", runtime,
+			       PLIST_FOR_LAT, PLIST_99);
+	}
+	show_latencies(&pipeline_stats, "Pipeline End to End Latencies", "usec",
+		       runtime, PLIST_FOR_LAT, PLIST_99);
+}
+
+/*
+ * --fanout, fold the subtask wakeup and gather latencies from all the
+ * workers
+ */
+static void combine_fanout_stats(struct stats *subtask_stats,
+				 struct stats *gather_stats,
+				 struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(subtask_stats, &worker->subtask_stats);
+			combine_stats(gather_stats, &worker->gather_stats);
+		}
+	}
+}
+
+static void combine_overshoot_stats(struct stats *overshoot_stats,
+				    struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(overshoot_stats, &worker->overshoot_stats);
+		}
+		/* pipeline stages sleep too */
+		for (i = 0; nr_stages > 1 && i < stage_offset(nr_stages); i++) {
+			worker = thread_data[index - worker_threads - 1].stage_threads + i;
+			combine_stats(overshoot_stats, &worker->overshoot_stats);
+		}
+	}
+}
+
+static void combine_wake_pattern_stats(struct stats *local,
+				       struct stats *remote,
+				       struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(local, &worker->local_wakeup_stats);
+			combine_stats(remote, &worker->remote_wakeup_stats);
+		}
+	}
+}
+
+static void combine_mem_stats(struct stats *mem_stats,
+			      struct stats *fault_stats,
+			      struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(mem_stats, &worker->mem_stats);
+			combine_stats(fault_stats, &worker->mem_fault_stats);
+		}
+	}
+}
+
+/* the TLB shootdown row of /proc/interrupts, summed over every cpu */
+static unsigned long long read_tlb_shootdowns(void)
+{
+	static char *buf;
+	static size_t size;
+	unsigned long long total = 0;
+	char *line;
+	char *c;
+
+	read_proc_file("/proc/interrupts", &buf, &size);
+	line = strstr(buf, "TLB:");
+	if (!line)
+		return 0;
+	c = line + 4;
+	while (1) {
+		char *end;
+		unsigned long long val = strtoull(c, &end, 10);
+
+		if (end == c)
+			break;
+		total += val;
+		c = end;
+	}
+	return total;
+}
+
+/*
+ * --perf-counters, fold and print the per request counter histograms
+ */
+static void show_perf_stats(struct thread_data *thread_data)
+{
+	struct stats *stats;
+	struct stats ipc_stats;
+	struct thread_data *worker;
+	unsigned int c;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	stats = calloc(NR_PERF_COUNTERS, sizeof(*stats));
+	if (!stats) {
+		perror("unable to allocate perf stats");
+		return;
+	}
+	memset(&ipc_stats, 0, sizeof(ipc_stats));
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			for (c = 0; c < NR_PERF_COUNTERS; c++)
+				combine_stats(&stats[c], &worker->perf_stats[c]);
+			combine_stats(&ipc_stats, &worker->ipc_stats);
+		}
+	}
+	for (c = 0; c < NR_PERF_COUNTERS; c++) {
+		char label[64];
+
+		if (stats[c].nr_samples == 0)
+			continue;
+		snprintf(label, sizeof(label), "%s per request",
+			 perf_counter_defs[c].label);
+		show_latencies(&stats[c], label, perf_counter_defs[c].units,
+			       runtime, PLIST_FOR_LAT, PLIST_99);
+	}
+	if (ipc_stats.nr_samples)
+		show_latencies(&ipc_stats, "IPC per request", "x100", runtime,
+			       PLIST_FOR_LAT, PLIST_50);
+	free(stats);
+}
+
+/*
+ * the wakeup and request latencies are exact: everything recorded
+ * before the flip is thrown away, everything after it lands in the new
+ * epoch and is kept
+ */
+static void reset_thread_stats(struct thread_data *thread_data)
+{
+	int i;
+
+	pthread_mutex_lock(&stats_lock);
+	__flip_thread_stats(thread_data, NULL, NULL);
+	memset(&total_wakeup_stats, 0, sizeof(total_wakeup_stats));
+	memset(&total_request_stats, 0, sizeof(total_request_stats));
+	memset(&rps_stats, 0, sizeof(rps_stats));
+	memset(&snap_wakeup_stats, 0, sizeof(snap_wakeup_stats));
+	memset(&snap_request_stats, 0, sizeof(snap_request_stats));
+	pthread_mutex_unlock(&stats_lock);
+
+	/* the reporter is the only one adding to these */
+	for (i = 0; i < nr_classes; i++)
+		memset(&classes[i].rps_stats, 0, sizeof(classes[i].rps_stats));
+
+	/*
+	 * the rest are cleared by the threads that write them, see
+	 * stats_reset_check().  They're exact per request: a request that
+	 * straddles the reset lands on one side or the other, and nothing
+	 * is torn
+	 */
+	gettimeofday(&stats_reset_time, NULL);
+	__sync_synchronize();
+	stats_reset_gen++;
+}
+
+/*
+ * once every thread has been joined, clear the stats of anyone who
+ * didn't record anything after the last reset
+ */
+static void settle_thread_stats(struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		spin_reset_check(&thread_data[index].spin);
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			stats_reset_check(worker);
+			spin_reset_check(&worker->spin);
+		}
+		for (i = 0; nr_stages > 1 && i < stage_offset(nr_stages); i++) {
+			worker = thread_data[index - worker_threads - 1].stage_threads + i;
+			stats_reset_check(worker);
+			spin_reset_check(&worker->spin);
+		}
+	}
+}
+
+/*
+ * --timeseries, one of these per tick in a ring buffer that gets
+ * dumped when the run is over
+ */
+struct tick_sample {
+	unsigned long long time_ms;
+	double rps;
+	unsigned int wakeup_p50;
+	unsigned int wakeup_p99;
+	unsigned int request_p99;
+};
+
+static void dump_timeseries(struct tick_sample *samples, unsigned long nr)
+{
+	unsigned long first = 0;
+	unsigned long i;
+	FILE *fp = stderr;
+
+	if (strcmp(timeseries_file, "-") != 0) {
+		fp = fopen(timeseries_file, "w");
+		if (!fp) {
+			perror("unable to open timeseries file");
+			return;
+		}
+	}
+
+	/* if we wrapped, the oldest sample is the one we'd write next */
+	if (nr > (unsigned long)timeseries_len)
+		first = nr - timeseries_len;
+
+	fprintf(fp, "# time_ms rps wakeup_p50 wakeup_p99 request_p99\n");
+	for (i = first; i < nr; i++) {
+		struct tick_sample *s = samples + i % timeseries_len;
+
+		fprintf(fp, "%llu %.2f %u %u %u\n", s->time_ms, s->rps,
+			s->wakeup_p50, s->wakeup_p99, s->request_p99);
+	}
+	if (fp != stderr)
+		fclose(fp);
+}
+
+/*
+ * sleep until the next tick.  We keep an absolute deadline so the
+ * reporting work doesn't make the ticks drift
+ */
+static void sleep_for_tick(struct timespec *next)
+{
+	next->tv_nsec += (long)tick_ms * 1000000;
+	while (next->tv_nsec >= 1000000000) {
+		next->tv_sec++;
+		next->tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next,
+			       NULL) == EINTR)
+		;
+}
+
+/*
+ * --class, hand every worker its class.  This happens before any thread
+ * starts, so the reporter never finds a worker without one
+ */
+static void assign_classes(struct thread_data *thread_data)
+{
+	int msg_i;
+	int c;
+	int i;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		struct thread_data *worker = thread_data +
+					     msg_i * (worker_threads + 1) + 1;
+
+		for (i = 0; i < worker_threads; i++) {
+			for (c = 0; c < nr_classes; c++) {
+				if (i >= classes[c].offset)
+					worker[i].klass = classes + c;
+			}
+		}
+	}
+}
+
+/* --class, fold each class's completions since the last tick into rps */
+static void class_rps_tick(struct thread_data *thread_data,
+			   unsigned long long delta)
+{
+	unsigned long long loops[MAX_CLASSES];
+	int msg_i;
+	int c;
+	int i;
+
+	memset(loops, 0, sizeof(loops));
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		struct thread_data *worker = thread_data +
+					     msg_i * (worker_threads + 1) + 1;
+
+		for (i = 0; i < worker_threads; i++) {
+			if (!worker[i].klass)
+				continue;
+			loops[worker[i].klass - classes] += worker[i].loop_count;
+		}
+	}
+	for (c = 0; c < nr_classes; c++) {
+		add_lat(&classes[c].rps_stats,
+			(double)(loops[c] - classes[c].last_loops) *
+			USEC_PER_SEC / delta);
+		classes[c].last_loops = loops[c];
+	}
+}
+
+static void show_class_stats(struct thread_data *thread_data)
+{
+	char name[128];
+	int msg_i;
+	int c;
+	int i;
+
+	for (c = 0; c < nr_classes; c++) {
+		struct stats wakeup;
+		struct stats request;
+
+		memset(&wakeup, 0, sizeof(wakeup));
+		memset(&request, 0, sizeof(request));
+		for (msg_i = 0; msg_i < message_threads; msg_i++) {
+			struct thread_data *worker = thread_data +
+						     msg_i * (worker_threads + 1) + 1;
+
+			for (i = 0; i < worker_threads; i++) {
+				if (worker[i].klass != classes + c)
+					continue;
+				combine_stats(&wakeup, &worker[i].class_wakeup_stats);
+				combine_stats(&request, &worker[i].class_request_stats);
+			}
+		}
+		snprintf(name, sizeof(name), "Class %.31s Wakeup Latencies",
+			 classes[c].name);
+		show_latencies(&wakeup, name, "usec", runtime, PLIST_FOR_LAT,
+			       PLIST_99);
+		snprintf(name, sizeof(name), "Class %.31s Request Latencies",
+			 classes[c].name);
+		show_latencies(&request, name, "usec", runtime, PLIST_FOR_LAT,
+			       PLIST_99);
+		snprintf(name, sizeof(name), "Class %.31s RPS", classes[c].name);
+		show_latencies(&classes[c].rps_stats, name, "requests", runtime,
+			       PLIST_FOR_RPS, PLIST_50);
+		memset(&classes[c].rps_stats, 0, sizeof(classes[c].rps_stats));
+		classes[c].last_loops = 0;
+	}
+}
+
+/* --schedule, how each phase went */
+struct phase_result {
+	struct stats wakeup;
+	struct stats request;
+	struct stats rps;
+	/* time into the phase of the last tick with rps off target */
+	unsigned long long settle_usec;
+	/* was the last tick we saw on target */
+	int settled;
+};
+static struct phase_result *phase_results;
+
+/* the rps goal offset usecs into a phase, ramps are linear */
+static int schedule_target(int phase, unsigned long long offset)
+{
+	struct load_phase *p = load_phases + phase;
+
+	if (offset > p->duration_usec)
+		offset = p->duration_usec;
+	return p->rps_start + (double)(p->rps_end - p->rps_start) *
+	       offset / p->duration_usec;
+}
+
+/* the rps threads and workers pick these up as they go */
+static void schedule_apply(int phase, unsigned long long offset)
+{
+	struct load_phase *p = load_phases + phase;
+
+	requests_per_sec = schedule_target(phase, offset) / message_threads;
+	if (requests_per_sec < 1)
+		requests_per_sec = 1;
+	operations = p->operations ? p->operations : base_operations;
+}
+
+/*
+ * one tick's worth of results for the current phase.  A tick is on
+ * target when its rps is within 10% of the goal, and a phase settles
+ * after the last tick that wasn't
+ */
+static void schedule_tick(int phase, unsigned long long offset, double rps,
+			  struct stats *tick_wakeup, struct stats *tick_request)
+{
+	struct phase_result *pr = phase_results + phase;
+	double target = schedule_target(phase, offset);
+
+	combine_stats(&pr->wakeup, tick_wakeup);
+	combine_stats(&pr->request, tick_request);
+	add_lat(&pr->rps, rps);
+	if (fabs(rps - target) > target / 10) {
+		pr->settle_usec = offset;
+		pr->settled = 0;
+	} else {
+		pr->settled = 1;
+	}
+}
+
+static void show_schedule_stats(void)
+{
+	int i;
+
+	fprintf(stderr, "per phase results:\n");
+	for (i = 0; i < nr_load_phases; i++) {
+		struct load_phase *p = load_phases + i;
+		struct phase_result *pr = phase_results + i;
+
+		fprintf(stderr, "\tphase %d %.1fs rps %d", i,
+			(double)p->duration_usec / USEC_PER_SEC, p->rps_start);
+		if (p->rps_end != p->rps_start)
+			fprintf(stderr, "-%d", p->rps_end);
+		fprintf(stderr, " ops %lu: rps p50 %u, wakeup p50 %u p99 %u, "
+			"request p50 %u p99 %u, ",
+			p->operations ? p->operations : base_operations,
+			stats_percentile(&pr->rps, 50.0),
+			stats_percentile(&pr->wakeup, 50.0),
+			stats_percentile(&pr->wakeup, 99.0),
+			stats_percentile(&pr->request, 50.0),
+			stats_percentile(&pr->request, 99.0));
+		if (!pr->rps.nr_samples || !pr->settled)
+			fprintf(stderr, "never settled\n");
+		else
+			fprintf(stderr, "settled after %llu ms\n",
+				pr->settle_usec / 1000);
+	}
+	free(phase_results);
+	phase_results = NULL;
+}
+
+/* runtime from the command line is in seconds.  Sleep until its up */
+static void sleep_for_runtime(struct thread_data *message_threads_mem)
+{
+	struct timeval now;
+	struct timeval zero_time;
+	struct timeval last_calc;
+	struct timeval last_rps_calc;
+	struct timeval last_auto_rps;
+	struct timeval start;
+	struct timespec next_tick;
+	struct stats wakeup_stats;
+	struct stats request_stats;
+	struct stats tick_wakeup_stats;
+	struct stats tick_request_stats;
+	struct tick_sample *samples = NULL;
+	unsigned long nr_samples = 0;
+	struct cpuidle_snapshot cpuidle_last;
+	struct cpuidle_snapshot cpuidle_now;
+	unsigned long long last_loop_count = 0;
+	unsigned long long loop_count;
+	unsigned long long loop_runtime;
+	unsigned long long delta;
+	unsigned long long runtime_delta;
+	unsigned long long runtime_usec = runtime * USEC_PER_SEC;
+	unsigned long long warmup_usec = warmuptime * USEC_PER_SEC;
+	unsigned long long interval_usec = intervaltime * USEC_PER_SEC;
+	unsigned long long zero_usec = zerotime * USEC_PER_SEC;
+	int warmup_done = 0;
+	int total_intervals = 0;
+	/* --schedule, where we are in it */
+	int cur_phase = 0;
+	unsigned long long phase_start = 0;
+
+	/* if we're autoscaling RPS */
+	struct auto_rps_state auto_rps_state;
+	struct cpu_stat_snapshot cpustat_last;
+	struct cpu_stat_snapshot cpustat_now;
+	struct energy_snapshot energy_last;
+	int done = 0;
+
+	memset(&auto_rps_state, 0, sizeof(auto_rps_state));
+
+	if (timeseries_file) {
+		samples = calloc(timeseries_len, sizeof(*samples));
+		if (!samples) {
+			perror("unable to allocate timeseries");
+			exit(1);
+		}
+	}
+
+	if (nr_load_phases) {
+		phase_results = calloc(nr_load_phases, sizeof(*phase_results));
+		if (!phase_results) {
+			perror("unable to allocate schedule results");
+			exit(1);
+		}
+	}
+
+	if (cpuidle_stats) {
+		cpuidle_snapshot_alloc(&cpuidle_last);
+		cpuidle_snapshot_alloc(&cpuidle_now);
+		cpuidle_snapshot_alloc(&cpuidle_run_start);
+		cpuidle_read(&cpuidle_run_start);
+		cpuidle_read(&cpuidle_last);
+	}
+
+	if (cpu_stats) {
+		cpustat_snapshot_alloc(&cpustat_last);
+		cpustat_snapshot_alloc(&cpustat_now);
+		cpustat_snapshot_alloc(&cpustat_run_start);
+		cpustat_read(&cpustat_run_start);
+		cpustat_read(&cpustat_last);
+	}
+
+	if (energy_stats) {
+		energy_read(&energy_run_start, 0);
+		energy_last = energy_run_start;
+	}
+
+	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
+	gettimeofday(&start, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &next_tick);
+	last_calc = start;
+	last_rps_calc = start;
+	last_auto_rps = start;
+	zero_time = start;
+
+	while(!done) {
+		int flipped = 0;
+
+		gettimeofday(&now, NULL);
+		runtime_delta = tvdelta(&start, &now);
+
+		if (runtime_usec && runtime_delta >= runtime_usec)
+			done = 1;
+		if (stop_requested)
+			done = 1;
+
+		if (!requests_per_sec && !pipe_test &&
+		    runtime_delta > warmup_usec &&
+		    !warmup_done && warmuptime) {
+			warmup_done = 1;
+			fprintf(stderr, "warmup done, zeroing stats\n");
+			zero_time = now;
+			reset_thread_stats(message_threads_mem);
+		} else if (!pipe_test) {
+			double rps;
+
+			/* count our RPS every round */
+			delta = tvdelta(&last_rps_calc, &now);
+
+			combine_message_thread_rps(message_threads_mem, &loop_count);
+			rps = (double)((loop_count - last_loop_count) * USEC_PER_SEC) / delta;
+			last_loop_count = loop_count;
+			last_rps_calc = now;
+
+			if (!auto_rps || auto_rps_target_hit) {
+				pthread_mutex_lock(&stats_lock);
+				add_lat(&rps_stats, rps);
+				pthread_mutex_unlock(&stats_lock);
+			}
+			if (nr_classes)
+				class_rps_tick(message_threads_mem, delta);
+
+			if (samples || nr_load_phases) {
+				memset(&tick_wakeup_stats, 0, sizeof(tick_wakeup_stats));
+				memset(&tick_request_stats, 0, sizeof(tick_request_stats));
+				flip_thread_stats(message_threads_mem,
+						  &tick_wakeup_stats,
+						  &tick_request_stats);
+				flipped = 1;
+			}
+
+			if (nr_load_phases) {
+				schedule_tick(cur_phase, runtime_delta - phase_start,
+					      rps, &tick_wakeup_stats,
+					      &tick_request_stats);
+				while (cur_phase < nr_load_phases - 1 &&
+				       runtime_delta - phase_start >=
+				       load_phases[cur_phase].duration_usec) {
+					phase_start += load_phases[cur_phase].duration_usec;
+					cur_phase++;
+					fprintf(stderr, "schedule: starting phase %d\n",
+						cur_phase);
+				}
+				schedule_apply(cur_phase, runtime_delta - phase_start);
+			}
+
+			if (samples) {
+				struct tick_sample *s = samples + nr_samples % timeseries_len;
+
+				s->time_ms = runtime_delta / 1000;
+				s->rps = rps;
+				s->wakeup_p50 = stats_percentile(&tick_wakeup_stats, 50.0);
+				s->wakeup_p99 = stats_percentile(&tick_wakeup_stats, 99.0);
+				s->request_p99 = stats_percentile(&tick_request_stats, 99.0);
+				nr_samples++;
+			}
+
+			delta = tvdelta(&last_calc, &now);
+			if (delta >= interval_usec) {
+
+				memset(&wakeup_stats, 0, sizeof(wakeup_stats));
+				memset(&request_stats, 0, sizeof(request_stats));
+				combine_message_thread_stats(&wakeup_stats,
+					     &request_stats, message_threads_mem,
+					     &loop_count, &loop_runtime, !flipped);
+				last_calc = now;
+
+				show_latencies(&wakeup_stats, "Wakeup Latencies",
+					       "usec", runtime_delta / USEC_PER_SEC,
+					       PLIST_FOR_LAT, PLIST_99);
+				show_latencies(&request_stats, "Request Latencies",
+					       "usec", runtime_delta / USEC_PER_SEC,
+					       PLIST_FOR_LAT, PLIST_99);
+				show_latencies(&rps_stats, "RPS",
+					       "requests", runtime_delta / USEC_PER_SEC,
+					       PLIST_FOR_RPS, PLIST_50);
+				fprintf(stderr, "current rps: %.2f\n", rps);
+				if (cpuidle_stats) {
+					struct cpuidle_snapshot tmp;
+
+					cpuidle_read(&cpuidle_now);
+					show_cpuidle_stats(&cpuidle_last, &cpuidle_now);
+					tmp = cpuidle_last;
+					cpuidle_last = cpuidle_now;
+					cpuidle_now = tmp;
+				}
+				if (cpu_stats) {
+					struct cpu_stat_snapshot tmp;
+
+					cpustat_read(&cpustat_now);
+					fprintf(stderr, "cpu usage:\n");
+					show_cpu_stats(&cpustat_last, &cpustat_now);
+					tmp = cpustat_last;
+					cpustat_last = cpustat_now;
+					cpustat_now = tmp;
+				}
+				if (energy_stats) {
+					struct energy_snapshot energy_now;
+
+					energy_read(&energy_now, loop_count);
+					show_energy_stats(&energy_last, &energy_now);
+					energy_last = energy_now;
+				}
+				total_intervals++;
+			}
+		}
+		if (zero_usec) {
+			unsigned long long zero_delta;
+			zero_delta = tvdelta(&zero_time, &now);
+			if (zero_delta > zero_usec) {
+				zero_time = now;
+				reset_thread_stats(message_threads_mem);
+			}
+		}
+		/* auto rps works in whole seconds no matter how fast we tick */
+		if (auto_rps && (!auto_rps_state.primed ||
+				 tvdelta(&last_auto_rps, &now) >= USEC_PER_SEC)) {
+			last_auto_rps = now;
+			auto_scale_rps(&auto_rps_state);
 		}
+		if (!done)
+			sleep_for_tick(&next_tick);
 	}
-}
-
-static pthread_mutex_t *lock_this_cpu(void)
-{
-	int cpu;
-	int cur_cpu;
-	pthread_mutex_t *lock;
+	__sync_synchronize();
+	stopping = 1;
 
-again:
-	cpu = sched_getcpu();
-	if (cpu < 0) {
-		perror("sched_getcpu failed\n");
-		exit(1);
+	if (samples) {
+		dump_timeseries(samples, nr_samples);
+		free(samples);
 	}
-	lock = &per_cpu_locks[cpu].lock;
-	while (pthread_mutex_trylock(lock) != 0)
-		nop;
-
-	cur_cpu = sched_getcpu();
-	if (cur_cpu < 0) {
-		perror("sched_getcpu failed\n");
-		exit(1);
+	if (cpuidle_stats) {
+		cpuidle_snapshot_free(&cpuidle_last);
+		cpuidle_snapshot_free(&cpuidle_now);
 	}
-
-	if (cur_cpu != cpu) {
-		/* we got the lock but we migrated */
-		pthread_mutex_unlock(lock);
-		goto again;
+	if (cpu_stats) {
+		cpustat_snapshot_free(&cpustat_last);
+		cpustat_snapshot_free(&cpustat_now);
 	}
-	return lock;
-
-}
-
-/*
- * spin or do some matrix arithmetic
- */
-static void do_work(struct thread_data *td)
-{
-	pthread_mutex_t *lock = NULL;
-	unsigned long i;
-
-	/* using --calibrate or --no-locking skips the locks */
-	if (!skip_locking)
-		lock = lock_this_cpu();
-	for (i = 0; i < operations; i++)
-		do_some_math(td);
-	if (!skip_locking)
-		pthread_mutex_unlock(lock);
 }
 
 /*
- * the worker thread is pretty simple, it just does a single spin and
- * then waits on a message from the message thread
+ * --repeat and --baseline work on a handful of headline numbers from
+ * each run.  For everything except rps, lower is better
  */
-void *worker_thread(void *arg)
-{
-	struct thread_data *td = arg;
-	struct timeval now;
-	struct timeval work_start;
-	struct timeval start;
-	unsigned long long delta;
-	struct request *req = NULL;
+struct repeat_metric {
+	char *name;
+	double pct;
+	int request;
+	int higher_is_better;
+};
 
-	gettimeofday(&start, NULL);
-	while(1) {
-		if (stopping)
-			break;
+static struct repeat_metric repeat_metrics[] = {
+	{ "rps", 0, 0, 1 },
+	{ "wakeup_p50", 50.0, 0, 0 },
+	{ "wakeup_p90", 90.0, 0, 0 },
+	{ "wakeup_p99", 99.0, 0, 0 },
+	{ "wakeup_p99.9", 99.9, 0, 0 },
+	{ "request_p50", 50.0, 1, 0 },
+	{ "request_p90", 90.0, 1, 0 },
+	{ "request_p99", 99.0, 1, 0 },
+	{ "request_p99.9", 99.9, 1, 0 },
+};
 
-		req = msg_and_wait(td);
-		if (requests_per_sec && !req)
-			continue;
+#define NR_REPEAT_METRICS (sizeof(repeat_metrics) / sizeof(repeat_metrics[0]))
 
-		do {
-			struct request *tmp;
+struct run_result {
+	struct stats wakeup;
+	struct stats request;
+	double rps;
+	unsigned long long requests;
+};
 
-			if (pipe_test) {
-				gettimeofday(&work_start, NULL);
-			} else {
-				if (calibrate_only) {
-					/*
-					 * in calibration mode, don't include the
-					 * usleep in the timing
-					 */
-					usleep(100);
-					gettimeofday(&work_start, NULL);
-				} else {
-					/*
-					 * lets start off with some simulated networking,
-					 * and also make sure we get a fresh clean timeslice
-					 */
-					gettimeofday(&work_start, NULL);
-					usleep(100);
-				}
-				do_work(td);
-			}
+struct repeat_values {
+	double v[NR_REPEAT_METRICS];
+};
 
-			gettimeofday(&now, NULL);
+static void repeat_result_values(struct run_result *res,
+				 struct repeat_values *values)
+{
+	unsigned int i;
 
-			td->runtime = tvdelta(&start, &now);
-			if (req) {
-				tmp = req->next;
-				free(req);
-				req = tmp;
-			}
-			td->loop_count++;
+	for (i = 0; i < NR_REPEAT_METRICS; i++) {
+		struct repeat_metric *m = repeat_metrics + i;
 
-			delta = tvdelta(&work_start, &now);
-			if (delta > 0)
-				add_lat(&td->request_stats, delta);
-		} while (req);
+		if (i == 0)
+			values->v[i] = res->rps;
+		else if (m->request)
+			values->v[i] = stats_percentile(&res->request, m->pct);
+		else
+			values->v[i] = stats_percentile(&res->wakeup, m->pct);
 	}
-	gettimeofday(&now, NULL);
-	td->runtime = tvdelta(&start, &now);
-
-	return NULL;
 }
 
-/*
- * the message thread starts his own gaggle of workers and then sits around
- * replying when they post him.  He collects latency stats as all the threads
- * exit
- */
-void *message_thread(void *arg)
+/* pipe mode has no request latencies, leave them out of the reports */
+static int repeat_metric_skipped(unsigned int i)
 {
-	struct thread_data *td = arg;
-	struct thread_data *worker_threads_mem = NULL;
-	int i;
-	int ret;
+	return pipe_test && repeat_metrics[i].request;
+}
 
-	worker_threads_mem = td + 1;
+/* two sided 95% student t values, indexed by degrees of freedom */
+static double t_table[] = {
+	0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+	2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+	2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+	2.042,
+};
 
-	if (!worker_threads_mem) {
-		perror("unable to allocate ram");
-		pthread_exit((void *)-ENOMEM);
-	}
+static double t_value(int df)
+{
+	if (df < (int)(sizeof(t_table) / sizeof(t_table[0])))
+		return t_table[df];
+	return 1.960;
+}
 
-	for (i = 0; i < worker_threads; i++) {
-		pthread_t tid;
-		worker_threads_mem[i].data = malloc(3 * sizeof(unsigned long) * matrix_size * matrix_size);
-		if (!worker_threads_mem[i].data) {
-			perror("unable to allocate ram");
-			pthread_exit((void *)-ENOMEM);
-		}
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *)a;
+	double y = *(double *)b;
 
-		worker_threads_mem[i].msg_thread = td;
-		ret = pthread_create(&tid, NULL, worker_thread,
-				     worker_threads_mem + i);
-		if (ret) {
-			fprintf(stderr, "error %d from pthread_create\n", ret);
-			exit(1);
-		}
-		worker_threads_mem[i].tid = tid;
-	}
+	if (x < y)
+		return -1;
+	return x > y;
+}
 
-	if (requests_per_sec)
-		run_rps_thread(worker_threads_mem);
-	else
-		run_msg_thread(td);
+static double median_of(double *v, int nr)
+{
+	double *sorted = malloc(nr * sizeof(double));
+	double ret;
 
-	for (i = 0; i < worker_threads; i++) {
-		fpost(&worker_threads_mem[i].futex);
-		pthread_join(worker_threads_mem[i].tid, NULL);
+	if (!sorted) {
+		perror("malloc");
+		exit(1);
 	}
-	return NULL;
+	memcpy(sorted, v, nr * sizeof(double));
+	qsort(sorted, nr, sizeof(double), cmp_double);
+	if (nr % 2)
+		ret = sorted[nr / 2];
+	else
+		ret = (sorted[nr / 2 - 1] + sorted[nr / 2]) / 2;
+	free(sorted);
+	return ret;
 }
 
-static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
-
-static double pretty_size(double number, char **str)
+/* pull one metric out of the per run values */
+static void metric_column(struct repeat_values *values, int nr,
+			  unsigned int metric, double *out)
 {
-	int divs = 0;
+	int i;
 
-	while(number >= 1024) {
-		if (units[divs + 1] == NULL)
-			break;
-		divs++;
-		number /= 1024;
-	}
-	*str = units[divs];
-	return number;
+	for (i = 0; i < nr; i++)
+		out[i] = values[i].v[metric];
 }
 
-/*
- * we want to calculate RPS more often than the full message stats,
- * so this is a less expensive walk through all the message threads
- * to pull that out
- */
-static void combine_message_thread_rps(struct thread_data *thread_data,
-				       unsigned long long *loop_count)
+static void show_repeat_summary(struct repeat_values *values, int nr)
 {
-	struct thread_data *worker;
+	double *col = malloc(nr * sizeof(double));
+	unsigned int m;
 	int i;
-	int msg_i;
-	int index = 0;
 
-	*loop_count = 0;
-	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
-		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			*loop_count += worker->loop_count;
-		}
+	if (!col) {
+		perror("malloc");
+		exit(1);
 	}
+	fprintf(stderr, "summary of %d runs (mean and 95%% confidence interval):\n",
+		nr);
+	for (m = 0; m < NR_REPEAT_METRICS; m++) {
+		double mean = 0;
+		double var = 0;
+		double ci;
+
+		if (repeat_metric_skipped(m))
+			continue;
+		metric_column(values, nr, m, col);
+		for (i = 0; i < nr; i++)
+			mean += col[i];
+		mean /= nr;
+		for (i = 0; i < nr; i++)
+			var += (col[i] - mean) * (col[i] - mean);
+		var /= nr - 1;
+		ci = t_value(nr - 1) * sqrt(var / nr);
+		fprintf(stderr, "\t%-14s %12.2f +/- %10.2f (%.1f%%) median %.2f\n",
+			repeat_metrics[m].name, mean, ci,
+			mean ? ci * 100 / mean : 0, median_of(col, nr));
+	}
+	free(col);
 }
 
-static void combine_message_thread_stats(struct stats *wakeup_stats,
-					 struct stats *request_stats,
-					struct thread_data *thread_data,
-					unsigned long long *loop_count,
-					unsigned long long *loop_runtime)
+/* one line per metric, the metric name followed by each run's value */
+static void save_baseline(struct repeat_values *values, int nr)
 {
-	struct thread_data *worker;
+	unsigned int m;
+	FILE *fp;
 	int i;
-	int msg_i;
-	int index = 0;
 
-	*loop_count = 0;
-	*loop_runtime = 0;
-	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
-		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			combine_stats(wakeup_stats, &worker->wakeup_stats);
-			combine_stats(request_stats, &worker->request_stats);
-			*loop_count += worker->loop_count;
-			*loop_runtime += worker->runtime;
-		}
+	fp = fopen(save_baseline_file, "w");
+	if (!fp) {
+		perror("unable to open baseline file");
+		exit(1);
+	}
+	for (m = 0; m < NR_REPEAT_METRICS; m++) {
+		if (repeat_metric_skipped(m))
+			continue;
+		fprintf(fp, "%s", repeat_metrics[m].name);
+		for (i = 0; i < nr; i++)
+			fprintf(fp, " %.2f", values[i].v[m]);
+		fprintf(fp, "\n");
 	}
+	fclose(fp);
 }
 
-static void reset_thread_stats(struct thread_data *thread_data)
+/*
+ * exact P(U >= u) for Mann-Whitney U with no ties, where U counts the
+ * (a, b) pairs with b > a.  The largest of the na + nb values is either
+ * one of b, beating all the a's, or one of a, beating none of the b's:
+ * f(m, n, u) = f(m, n - 1, u - m) + f(m - 1, n, u)
+ */
+static double mann_whitney_exact(int na, int nb, double u)
 {
-	struct thread_data *worker;
-	int i;
-	int msg_i;
-	int index = 0;
-
-	memset(&rps_stats, 0, sizeof(rps_stats));
-	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
-		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			memset(&worker->wakeup_stats, 0, sizeof(worker->wakeup_stats));
-			memset(&worker->request_stats, 0, sizeof(worker->request_stats));
+	int umax = na * nb;
+	double *f = calloc((na + 1) * (nb + 1) * (umax + 1), sizeof(double));
+	double total = 0;
+	double tail = 0;
+	int m, n, k;
+
+#define F(m, n, k) f[((m) * (nb + 1) + (n)) * (umax + 1) + (k)]
+	if (!f) {
+		perror("calloc");
+		exit(1);
+	}
+	for (m = 0; m <= na; m++) {
+		for (n = 0; n <= nb; n++) {
+			if (m == 0 || n == 0) {
+				F(m, n, 0) = 1;
+				continue;
+			}
+			for (k = 0; k <= m * n; k++) {
+				F(m, n, k) = F(m - 1, n, k);
+				if (k >= m)
+					F(m, n, k) += F(m, n - 1, k - m);
+			}
 		}
 	}
+	for (k = 0; k <= umax; k++) {
+		total += F(na, nb, k);
+		if (k >= u)
+			tail += F(na, nb, k);
+	}
+#undef F
+	free(f);
+	return tail / total;
 }
 
-/* runtime from the command line is in seconds.  Sleep until its up */
-static void sleep_for_runtime(struct thread_data *message_threads_mem)
+/*
+ * Mann-Whitney U, the chance that a run from b scores higher than a run
+ * from a.  Returns the one sided p value for b being larger than a,
+ * exact for small samples without ties, otherwise from the normal
+ * approximation with tie and continuity correction.  With fewer than 4
+ * runs on either side nothing will ever look significant at 0.05,
+ * which is the honest answer.
+ */
+static double mann_whitney_p(double *a, int na, double *b, int nb)
 {
-	struct timeval now;
-	struct timeval zero_time;
-	struct timeval last_calc;
-	struct timeval last_rps_calc;
-	struct timeval start;
-	struct stats wakeup_stats;
-	struct stats request_stats;
-	unsigned long long last_loop_count = 0;
-	unsigned long long loop_count;
-	unsigned long long loop_runtime;
-	unsigned long long delta;
-	unsigned long long runtime_delta;
-	unsigned long long runtime_usec = runtime * USEC_PER_SEC;
-	unsigned long long warmup_usec = warmuptime * USEC_PER_SEC;
-	unsigned long long interval_usec = intervaltime * USEC_PER_SEC;
-	unsigned long long zero_usec = zerotime * USEC_PER_SEC;
-	int warmup_done = 0;
-	int total_intervals = 0;
+	int n = na + nb;
+	double *all = malloc(n * sizeof(double));
+	double rank_b = 0;
+	double ties = 0;
+	double u, mean, sigma, z;
+	int i, j;
+
+	if (!all) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(all, a, na * sizeof(double));
+	memcpy(all + na, b, nb * sizeof(double));
+	qsort(all, n, sizeof(double), cmp_double);
+
+	/* average ranks, and the tie term for the variance */
+	for (i = 0; i < n; i = j) {
+		double rank;
+		double t;
+		int k;
+
+		for (j = i; j < n && all[j] == all[i]; j++)
+			;
+		rank = (i + 1 + j) / 2.0;
+		t = j - i;
+		ties += t * t * t - t;
+		for (k = 0; k < nb; k++) {
+			if (b[k] == all[i])
+				rank_b += rank;
+		}
+	}
+	free(all);
+
+	u = rank_b - (double)nb * (nb + 1) / 2;
+	if (ties == 0 && na <= 25 && nb <= 25)
+		return mann_whitney_exact(na, nb, u);
+	mean = (double)na * nb / 2;
+	sigma = sqrt((double)na * nb / 12 *
+		     ((n + 1) - ties / ((double)n * (n - 1))));
+	if (sigma == 0)
+		return 1.0;
+	z = (u - mean - 0.5) / sigma;
+	return 0.5 * erfc(z / sqrt(2));
+}
 
-	/* if we're autoscaling RPS */
-	int proc_stat_fd = -1;
-	unsigned long long total_time = 0;
-	unsigned long long total_idle = 0;
-	int done = 0;
+/*
+ * compare this run against --baseline.  A metric regresses when the
+ * Mann-Whitney test says it got worse at --alpha, and the median moved
+ * by at least --regress-pct.  Returns 1 if anything regressed
+ */
+static int compare_baseline(struct repeat_values *values, int nr)
+{
+	double *base[NR_REPEAT_METRICS] = { NULL };
+	int base_nr[NR_REPEAT_METRICS] = { 0 };
+	double *col = malloc(nr * sizeof(double));
+	char line[4096];
+	unsigned int m;
+	int regressed = 0;
+	FILE *fp;
+
+	if (!col) {
+		perror("malloc");
+		exit(1);
+	}
+	fp = fopen(baseline_file, "r");
+	if (!fp) {
+		perror("unable to open baseline file");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		char *save;
+		char *tok = strtok_r(line, " \t\n", &save);
 
-	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
-	gettimeofday(&start, NULL);
-	last_calc = start;
-	last_rps_calc = start;
-	zero_time = start;
+		if (!tok)
+			continue;
+		for (m = 0; m < NR_REPEAT_METRICS; m++) {
+			if (strcmp(tok, repeat_metrics[m].name) == 0)
+				break;
+		}
+		if (m == NR_REPEAT_METRICS || base[m])
+			continue;
+		base[m] = malloc(sizeof(line) / 2 * sizeof(double));
+		if (!base[m]) {
+			perror("malloc");
+			exit(1);
+		}
+		while ((tok = strtok_r(NULL, " \t\n", &save)) != NULL)
+			base[m][base_nr[m]++] = atof(tok);
+	}
+	fclose(fp);
 
-	while(!done) {
-		gettimeofday(&now, NULL);
-		runtime_delta = tvdelta(&start, &now);
+	fprintf(stderr, "comparison with baseline %s:\n", baseline_file);
+	for (m = 0; m < NR_REPEAT_METRICS; m++) {
+		struct repeat_metric *metric = repeat_metrics + m;
+		double base_median, median, change, p;
+		int worse;
 
-		if (runtime_usec && runtime_delta >= runtime_usec)
-			done = 1;
+		if (repeat_metric_skipped(m) || !base_nr[m])
+			continue;
+		metric_column(values, nr, m, col);
+		base_median = median_of(base[m], base_nr[m]);
+		median = median_of(col, nr);
+		change = base_median ? (median - base_median) * 100 / base_median : 0;
+
+		if (metric->higher_is_better)
+			p = mann_whitney_p(col, nr, base[m], base_nr[m]);
+		else
+			p = mann_whitney_p(base[m], base_nr[m], col, nr);
+		worse = metric->higher_is_better ? change <= -regress_pct :
+						   change >= regress_pct;
+		worse = worse && p < regress_alpha;
+		regressed |= worse;
+
+		fprintf(stderr, "\t%-14s %12.2f -> %12.2f (%+.1f%%) p=%.4f%s\n",
+			metric->name, base_median, median, change, p,
+			worse ? " REGRESSION" : "");
+	}
+	if (regressed)
+		fprintf(stderr, "significant regression against baseline\n");
 
-		if (!requests_per_sec && !pipe_test &&
-		    runtime_delta > warmup_usec &&
-		    !warmup_done && warmuptime) {
-			warmup_done = 1;
-			fprintf(stderr, "warmup done, zeroing stats\n");
-			zero_time = now;
-			reset_thread_stats(message_threads_mem);
-		} else if (!pipe_test) {
-			double rps;
+	for (m = 0; m < NR_REPEAT_METRICS; m++)
+		free(base[m]);
+	free(col);
+	return regressed;
+}
 
-			/* count our RPS every round */
-			delta = tvdelta(&last_rps_calc, &now);
+/* copy the first line of a file with a given prefix, minus the prefix */
+static int read_line_value(char *path, char *prefix, char *buf, int len)
+{
+	char line[1024];
+	FILE *fp;
+	int ret = -1;
 
-			combine_message_thread_rps(message_threads_mem, &loop_count);
-			rps = (double)((loop_count - last_loop_count) * USEC_PER_SEC) / delta;
-			last_loop_count = loop_count;
-			last_rps_calc = now;
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		char *c;
 
-			if (!auto_rps || auto_rps_target_hit)
-				add_lat(&rps_stats, rps);
+		if (strncmp(line, prefix, strlen(prefix)) != 0)
+			continue;
+		c = line + strlen(prefix);
+		c += strspn(c, " \t:");
+		snprintf(buf, len, "%s", c);
+		c = strchr(buf, '\n');
+		if (c)
+			*c = '\0';
+		ret = 0;
+		break;
+	}
+	fclose(fp);
+	return ret;
+}
 
-			delta = tvdelta(&last_calc, &now);
-			if (delta >= interval_usec) {
+/*
+ * count sockets, cores and hardware threads from sysfs.  Cores are
+ * unique (package, core_id) pairs
+ */
+static void read_topology(int *sockets, int *cores, int *threads)
+{
+	int nr_cpus = get_nprocs_conf();
+	unsigned long long *pkg = calloc(nr_cpus, sizeof(*pkg));
+	unsigned long long *core = calloc(nr_cpus, sizeof(*core));
+	char path[256];
+	int cpu;
+	int i;
 
-				memset(&wakeup_stats, 0, sizeof(wakeup_stats));
-				memset(&request_stats, 0, sizeof(request_stats));
-				combine_message_thread_stats(&wakeup_stats,
-					     &request_stats, message_threads_mem,
-					     &loop_count, &loop_runtime);
-				last_calc = now;
+	*sockets = 0;
+	*cores = 0;
+	*threads = 0;
+	if (!pkg || !core)
+		goto out;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		unsigned long long p;
+		unsigned long long c;
+		int new_pkg = 1;
+		int new_core = 1;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		if (read_sysfs_ull(path, &p))
+			continue;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		if (read_sysfs_ull(path, &c))
+			continue;
 
-				show_latencies(&wakeup_stats, "Wakeup Latencies",
-					       "usec", runtime_delta / USEC_PER_SEC,
-					       PLIST_FOR_LAT, PLIST_99);
-				show_latencies(&request_stats, "Request Latencies",
-					       "usec", runtime_delta / USEC_PER_SEC,
-					       PLIST_FOR_LAT, PLIST_99);
-				show_latencies(&rps_stats, "RPS",
-					       "requests", runtime_delta / USEC_PER_SEC,
-					       PLIST_FOR_RPS, PLIST_50);
-				fprintf(stderr, "current rps: %.2f\n", rps);
-				total_intervals++;
-			}
-		}
-		if (zero_usec) {
-			unsigned long long zero_delta;
-			zero_delta = tvdelta(&zero_time, &now);
-			if (zero_delta > zero_usec) {
-				zero_time = now;
-				reset_thread_stats(message_threads_mem);
+		for (i = 0; i < *threads; i++) {
+			if (pkg[i] == p) {
+				new_pkg = 0;
+				if (core[i] == c)
+					new_core = 0;
 			}
 		}
-		if (auto_rps)
-			auto_scale_rps(&proc_stat_fd, &total_time, &total_idle);
-		if (!done)
-			sleep(1);
+		pkg[*threads] = p;
+		core[*threads] = c;
+		(*threads)++;
+		*sockets += new_pkg;
+		*cores += new_core;
 	}
-	if (proc_stat_fd >= 0)
-		close(proc_stat_fd);
-	__sync_synchronize();
-	stopping = 1;
+out:
+	free(pkg);
+	free(core);
 }
 
+/*
+ * --manifest, everything needed to tie a result back to the exact
+ * conditions that produced it: effective options after all of
+ * parse_options()'s side effects, the seed, the build and the box
+ */
+static void write_manifest(int ac, char **av, struct stats *wakeup_stats,
+			   struct stats *request_stats, double avg_rps)
+{
+	struct utsname uts;
+	char buf[1024];
+	FILE *fp;
+	int sockets, cores, threads;
+	int i;
+
+	fp = fopen(manifest_file, "w");
+	if (!fp) {
+		perror("unable to open manifest file");
+		return;
+	}
+
+	fprintf(fp, "schbench_version: %s\n",
+		SCHBENCH_VERSION[0] ? SCHBENCH_VERSION : "unknown");
+	fprintf(fp, "build: %s %s, gcc %s\n", __DATE__, __TIME__, __VERSION__);
+	fprintf(fp, "command:");
+	for (i = 0; i < ac; i++)
+		fprintf(fp, " %s", av[i]);
+	fprintf(fp, "\n");
+	fprintf(fp, "seed: %llu\n", seed);
+
+	fprintf(fp, "message_threads: %d\n", message_threads);
+	fprintf(fp, "worker_threads: %d\n", worker_threads);
+	fprintf(fp, "runtime: %d\n", runtime);
+	fprintf(fp, "warmuptime: %d\n", warmuptime);
+	fprintf(fp, "intervaltime: %d\n", intervaltime);
+	fprintf(fp, "zerotime: %d\n", zerotime);
+	fprintf(fp, "cache_footprint_kb: %lu\n", cache_footprint_kb);
+	fprintf(fp, "matrix_size: %lu\n", matrix_size);
+	fprintf(fp, "operations: %lu\n", operations);
+	fprintf(fp, "auto_rps: %d\n", auto_rps);
+	fprintf(fp, "requests_per_sec: %d\n", requested_rps);
+	fprintf(fp, "final_requests_per_sec: %d\n",
+		requests_per_sec * message_threads);
+	fprintf(fp, "pipe_test: %d\n", pipe_test);
+	fprintf(fp, "calibrate_only: %d\n", calibrate_only);
+	fprintf(fp, "skip_locking: %d\n", skip_locking);
+	fprintf(fp, "work_steal: %d\n", work_steal);
+	fprintf(fp, "spin_usec: %u\n", spin_usec);
+	fprintf(fp, "spin_adaptive: %d\n", spin_adaptive);
+	fprintf(fp, "pipeline: %s\n", pipeline_spec ? pipeline_spec : "none");
+	fprintf(fp, "fanout: %d\n", fanout);
+	fprintf(fp, "fanout_random: %d\n", fanout_random);
+	fprintf(fp, "request_template: %s\n",
+		request_template_spec ? request_template_spec : "default");
+	fprintf(fp, "sleep_type: %s\n", sleep_type_names[sleep_type]);
+	fprintf(fp, "tick_ms: %d\n", tick_ms);
+	fprintf(fp, "cpu_dma_latency: %d\n", cpu_dma_latency);
+	fprintf(fp, "repeat: %d\n", repeat_runs);
+	fprintf(fp, "repeat_cooldown: %d\n", repeat_cooldown);
+	fprintf(fp, "baseline: %s\n", baseline_file ? baseline_file : "none");
+	fprintf(fp, "layout: %s\n", layout_names[layout]);
+	fprintf(fp, "churn_pct: %d\n", churn_pct);
+	fprintf(fp, "churn_ramp: %d\n", churn_ramp);
+	fprintf(fp, "churn_interval: %d\n", churn_interval);
+	fprintf(fp, "schedule: %s\n", schedule_spec ? schedule_spec : "none");
+	fprintf(fp, "auto_rps_exclude: %d\n", auto_rps_exclude);
+	fprintf(fp, "mem_mode: %s\n", mem_mode_names[mem_mode]);
+	fprintf(fp, "buffer_mem: %s\n", buffer_mem_names[buffer_mem]);
+	fprintf(fp, "wake_pattern: %s\n", wake_pattern_names[wake_pattern]);
+	for (i = 0; i < nr_classes; i++)
+		fprintf(fp, "class: %s workers %d rps %d ops %lu policy %d "
+			"rt_prio %d nice %d\n", classes[i].name,
+			classes[i].workers, classes[i].rps, classes[i].operations,
+			classes[i].sched.policy, classes[i].sched.rt_prio,
+			classes[i].sched.set_nice ? classes[i].sched.nice : 0);
+	fprintf(fp, "fibers: %d\n", fibers);
+	fprintf(fp, "work_plugin: %s\n",
+		work_plugin_spec ? work_plugin_spec : "none");
+	for (i = 0; energy_stats && i < nr_energy_domains; i++)
+		fprintf(fp, "energy_domain: %s %s%s\n", energy_domains[i].name,
+			energy_domains[i].path,
+			energy_domains[i].in_total ? " (total)" : "");
+	fprintf(fp, "lock: %s count %d pct %d read_pct %d\n",
+		shared_lock_names[shared_lock_type], shared_lock_count,
+		shared_lock_pct, shared_lock_read_pct);
+	if (periodic_threads)
+		fprintf(fp, "periodic: threads %d period %lu policy %d "
+			"rt_prio %d nice %d timer %s\n", periodic_threads,
+			periodic_period, periodic_sched.policy,
+			periodic_sched.rt_prio,
+			periodic_sched.set_nice ? periodic_sched.nice : 0,
+			periodic_timer_names[periodic_timer]);
+
+	if (uname(&uts) == 0) {
+		fprintf(fp, "kernel: %s %s %s\n", uts.sysname, uts.release,
+			uts.version);
+		fprintf(fp, "machine: %s\n", uts.machine);
+		fprintf(fp, "hostname: %s\n", uts.nodename);
+	}
+	if (read_line_value("/proc/cmdline", "", buf, sizeof(buf)) == 0)
+		fprintf(fp, "kernel_cmdline: %s\n", buf);
+	if (read_line_value("/proc/cpuinfo", "model name", buf, sizeof(buf)) == 0 ||
+	    read_line_value("/proc/cpuinfo", "CPU part", buf, sizeof(buf)) == 0 ||
+	    read_line_value("/proc/cpuinfo", "cpu", buf, sizeof(buf)) == 0)
+		fprintf(fp, "cpu_model: %s\n", buf);
+	fprintf(fp, "cpus_online: %d\n", get_nprocs());
+	fprintf(fp, "cpus_configured: %d\n", get_nprocs_conf());
+	read_topology(&sockets, &cores, &threads);
+	fprintf(fp, "sockets: %d\n", sockets);
+	fprintf(fp, "cores: %d\n", cores);
+	fprintf(fp, "hw_threads: %d\n", threads);
+	if (read_line_value("/sys/devices/system/cpu/smt/control", "", buf,
+			    sizeof(buf)) == 0)
+		fprintf(fp, "smt: %s\n", buf);
+	if (read_line_value("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
+			    "", buf, sizeof(buf)) == 0)
+		fprintf(fp, "governor: %s\n", buf);
+	if (read_line_value("/sys/devices/system/cpu/cpu0/cpufreq/scaling_driver",
+			    "", buf, sizeof(buf)) == 0)
+		fprintf(fp, "cpufreq_driver: %s\n", buf);
+
+	fprintf(fp, "wakeup_p50: %u\n", stats_percentile(wakeup_stats, 50.0));
+	fprintf(fp, "wakeup_p99: %u\n", stats_percentile(wakeup_stats, 99.0));
+	fprintf(fp, "request_p50: %u\n", stats_percentile(request_stats, 50.0));
+	fprintf(fp, "request_p99: %u\n", stats_percentile(request_stats, 99.0));
+	fprintf(fp, "average_rps: %.2f\n", avg_rps);
+	fclose(fp);
+}
 
-int main(int ac, char **av)
+/* one full run of the configured workload, the results go into res */
+static void run_once(struct run_result *res)
 {
 	int i;
 	int ret;
@@ -1346,44 +7266,34 @@ int main(int ac, char **av)
 	double loops_per_sec;
 	unsigned long long loop_count;
 	unsigned long long loop_runtime;
-
-	parse_options(ac, av);
-
-	if (worker_threads == 0) {
-		unsigned long num_cpus = get_nprocs();
-
-		worker_threads = (num_cpus + message_threads - 1) / message_threads;
-
-		fprintf(stderr, "setting worker threads to %d\n", worker_threads);
-	}
-
-	matrix_size = sqrt(cache_footprint_kb * 1024 / 3 / sizeof(unsigned long));
-
-	num_cpu_locks = get_nprocs();
-	per_cpu_locks = calloc(num_cpu_locks, sizeof(struct per_cpu_lock));
-	if (!per_cpu_locks) {
-		perror("unable to allocate memory for per cpu locks\n");
-		exit(1);
-	}
-
-	for (i = 0; i < num_cpu_locks; i++) {
-		pthread_mutex_t *lock = &per_cpu_locks[i].lock;
-		ret = pthread_mutex_init(lock, NULL);
-		if (ret) {
-			perror("mutex init failed\n");
-			exit(1);
-		}
-	}
-
-	requests_per_sec /= message_threads;
+	struct stats local_stats;
+	struct stats stolen_stats;
+	unsigned long long steals = 0;
+	unsigned long long failed_steals = 0;
+	struct spin_state spin_total;
+	struct stats subtask_stats;
+	struct stats gather_stats;
+	struct stats overshoot_stats;
+	unsigned long long tlb_shootdowns = 0;
+	struct timeval stats_end;
+
+	requests_per_sec = requested_rps / message_threads;
+	auto_rps_target_hit = 0;
+	if (nr_load_phases)
+		schedule_apply(0, 0);
 	loops_per_sec = 0;
 	stopping = 0;
 	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
 	memset(&request_stats, 0, sizeof(request_stats));
 	memset(&rps_stats, 0, sizeof(rps_stats));
+	memset(&total_wakeup_stats, 0, sizeof(total_wakeup_stats));
+	memset(&total_request_stats, 0, sizeof(total_request_stats));
+	memset(&snap_wakeup_stats, 0, sizeof(snap_wakeup_stats));
+	memset(&snap_request_stats, 0, sizeof(snap_request_stats));
 
-	message_threads_mem = calloc(message_threads * worker_threads + message_threads,
-				      sizeof(struct thread_data));
+	message_threads_mem = alloc_buffer((message_threads * worker_threads +
+					    message_threads) *
+					   sizeof(struct thread_data));
 
 
 	if (!message_threads_mem) {
@@ -1391,10 +7301,23 @@ int main(int ac, char **av)
 		exit(1);
 	}
 
+	pthread_mutex_lock(&stats_lock);
+	all_threads = message_threads_mem;
+	run_live = 1;
+	pthread_mutex_unlock(&stats_lock);
+
+	pthread_barrier_init(&home_barrier, NULL, message_threads);
+	gettimeofday(&stats_reset_time, NULL);
+	if (nr_classes)
+		assign_classes(message_threads_mem);
+
 	/* start our message threads, each one starts its own workers */
 	for (i = 0; i < message_threads; i++) {
 		pthread_t tid;
 		int index = i * worker_threads + i;
+		message_threads_mem[index].rand_seed = mix_seed(seed, i);
+		if (group_cpus)
+			message_threads_mem[index].cpus = group_cpus[i];
 		ret = pthread_create(&tid, NULL, message_thread,
 				     message_threads_mem + index);
 		if (ret) {
@@ -1404,6 +7327,11 @@ int main(int ac, char **av)
 		message_threads_mem[index].tid = tid;
 	}
 
+	if (nr_mem_phases)
+		tlb_shootdowns = read_tlb_shootdowns();
+	if (periodic_threads)
+		start_periodic_threads();
+
 	sleep_for_runtime(message_threads_mem);
 
 	for (i = 0; i < message_threads; i++) {
@@ -1411,17 +7339,34 @@ int main(int ac, char **av)
 		fpost(&message_threads_mem[index].futex);
 		pthread_join(message_threads_mem[index].tid, NULL);
 	}
+	pthread_barrier_destroy(&home_barrier);
+	gettimeofday(&stats_end, NULL);
+	settle_thread_stats(message_threads_mem);
 	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
 	memset(&request_stats, 0, sizeof(request_stats));
 	combine_message_thread_stats(&wakeup_stats, &request_stats,
 				     message_threads_mem,
-				     &loop_count, &loop_runtime);
+				     &loop_count, &loop_runtime, 1);
+	if (work_steal) {
+		memset(&local_stats, 0, sizeof(local_stats));
+		memset(&stolen_stats, 0, sizeof(stolen_stats));
+		combine_steal_stats(&local_stats, &stolen_stats,
+				    message_threads_mem, &steals,
+				    &failed_steals);
+	}
+	combine_spin_stats(&spin_total, message_threads_mem);
+	memset(&overshoot_stats, 0, sizeof(overshoot_stats));
+	combine_overshoot_stats(&overshoot_stats, message_threads_mem);
+	if (fanout) {
+		memset(&subtask_stats, 0, sizeof(subtask_stats));
+		memset(&gather_stats, 0, sizeof(gather_stats));
+		combine_fanout_stats(&subtask_stats, &gather_stats,
+				     message_threads_mem);
+	}
 
 	loops_per_sec = loop_count * USEC_PER_SEC;
 	loops_per_sec /= loop_runtime;
 
-	free(message_threads_mem);
-
 	if (pipe_test) {
 		char *pretty;
 		double mb_per_sec;
@@ -1440,10 +7385,558 @@ int main(int ac, char **av)
 			       PLIST_FOR_LAT, PLIST_99);
 		show_latencies(&rps_stats, "RPS", "requests", runtime,
 			       PLIST_FOR_RPS, PLIST_50);
+		show_latencies(&overshoot_stats, "Timer Overshoot", "usec",
+			       runtime, PLIST_FOR_LAT, PLIST_99);
+		if (work_steal) {
+			show_latencies(&local_stats, "Local Request Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&stolen_stats, "Stolen Request Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			fprintf(stderr, "steals: %llu failed steal attempts: %llu\n",
+				steals, failed_steals);
+		}
 		if (!auto_rps)
 			fprintf(stderr, "average rps: %.2f\n",
 				(double)(loop_count) / runtime);
+		if (energy_stats) {
+			struct energy_snapshot run_end;
+
+			energy_read(&run_end, loop_count);
+			fprintf(stderr, "energy over the whole run:\n");
+			show_energy_stats(&energy_run_start, &run_end);
+		}
+		if (cpuidle_stats) {
+			struct cpuidle_snapshot run_end;
+
+			cpuidle_snapshot_alloc(&run_end);
+			cpuidle_read(&run_end);
+			fprintf(stderr, "cpuidle over the whole run:\n");
+			show_cpuidle_stats(&cpuidle_run_start, &run_end);
+			cpuidle_snapshot_free(&run_end);
+			cpuidle_snapshot_free(&cpuidle_run_start);
+		}
+		if (cpu_stats) {
+			struct cpu_stat_snapshot run_end;
+
+			cpustat_snapshot_alloc(&run_end);
+			cpustat_read(&run_end);
+			fprintf(stderr, "cpu usage over the whole run:\n");
+			show_cpu_stats(&cpustat_run_start, &run_end);
+			cpustat_snapshot_free(&run_end);
+			cpustat_snapshot_free(&cpustat_run_start);
+		}
+		if (fanout) {
+			show_latencies(&subtask_stats, "Subtask Wakeup Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&gather_stats, "Gather Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+		}
+		if (nr_stages > 1)
+			show_pipeline_stats(message_threads_mem);
+		if (perf_counters)
+			show_perf_stats(message_threads_mem);
+		if (llc_stats)
+			show_llc_stats(message_threads_mem);
+		if (nr_load_phases)
+			show_schedule_stats();
+		if (nr_classes)
+			show_class_stats(message_threads_mem);
+		if (periodic_threads)
+			stop_periodic_threads();
+		if (fibers) {
+			struct stats dispatch;
+			struct stats request;
+			unsigned long long switches;
+
+			memset(&dispatch, 0, sizeof(dispatch));
+			memset(&request, 0, sizeof(request));
+			combine_fiber_stats(message_threads_mem, &dispatch,
+					    &request, &switches);
+			show_latencies(&dispatch, "Fiber Dispatch Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&request, "Fiber Request Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			fprintf(stderr, "fiber switches: %llu\n", switches);
+		}
+		if (shared_lock_type != SHARED_LOCK_NONE) {
+			struct stats wait;
+			struct stats hold;
+			struct stats handoff;
+			unsigned long long acquires;
+			unsigned long long contended;
+
+			memset(&wait, 0, sizeof(wait));
+			memset(&hold, 0, sizeof(hold));
+			memset(&handoff, 0, sizeof(handoff));
+			combine_lock_stats(message_threads_mem, &wait, &hold,
+					   &handoff, &acquires, &contended);
+			show_latencies(&wait, "Lock Wait Latencies", "usec",
+				       runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&hold, "Lock Hold Times", "usec",
+				       runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&handoff, "Lock Handoff Latencies", "usec",
+				       runtime, PLIST_FOR_LAT, PLIST_99);
+			fprintf(stderr, "lock acquisitions: %llu contended: %llu\n",
+				acquires, contended);
+		}
+		if (wake_pattern != WAKE_LOCAL) {
+			struct stats local;
+			struct stats remote;
+
+			memset(&local, 0, sizeof(local));
+			memset(&remote, 0, sizeof(remote));
+			combine_wake_pattern_stats(&local, &remote,
+						   message_threads_mem);
+			show_latencies(&local, "Local Wakeup Latencies", "usec",
+				       runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&remote, "Remote Wakeup Latencies", "usec",
+				       runtime, PLIST_FOR_LAT, PLIST_99);
+		}
+		if (nr_mem_phases) {
+			struct stats mem_stats;
+			struct stats fault_stats;
+
+			memset(&mem_stats, 0, sizeof(mem_stats));
+			memset(&fault_stats, 0, sizeof(fault_stats));
+			combine_mem_stats(&mem_stats, &fault_stats,
+					  message_threads_mem);
+			show_latencies(&mem_stats, "Memory Phase Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&fault_stats, "Memory Phase Page Faults",
+				       "faults", runtime, PLIST_FOR_LAT, PLIST_99);
+			fprintf(stderr, "TLB shootdowns during the run: %llu\n",
+				read_tlb_shootdowns() - tlb_shootdowns);
+		}
+		if (churn_pct || churn_ramp) {
+			struct stats create;
+			struct stats first_run;
+			struct stats young;
+			unsigned long long replaced;
+
+			memset(&create, 0, sizeof(create));
+			memset(&first_run, 0, sizeof(first_run));
+			memset(&young, 0, sizeof(young));
+			combine_churn_stats(message_threads_mem, &create,
+					    &first_run, &young, &replaced);
+			fprintf(stderr, "churn: %llu workers started\n", replaced);
+			show_latencies(&create, "Thread Creation Latencies", "usec",
+				       runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&first_run, "New Worker First Run Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+			show_latencies(&young, "New Worker Wakeup Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+		}
+	}
+
+	if (spin_usec) {
+		/* the spin counters only go back to the last reset */
+		double cpu_time = (double)tvdelta(&stats_reset_time, &stats_end) *
+				  get_nprocs();
+
+		fprintf(stderr, "spin: %llu waits satisfied spinning, %llu sleeping, "
+			"%.2f cpu sec spinning (%.2f%% of all cpus)\n",
+			spin_total.spin_wakes, spin_total.sleep_wakes,
+			(double)spin_total.spin_time / USEC_PER_SEC,
+			spin_total.spin_time * 100.0 / cpu_time);
+	}
+
+	if (trace_file) {
+		int nr_threads = message_threads * worker_threads + message_threads;
+		int nr_stage_threads = nr_stages > 1 ? stage_offset(nr_stages) : 0;
+
+		trace_export(message_threads_mem, nr_threads, nr_stage_threads);
+		for (i = 0; i < nr_threads; i++) {
+			struct thread_data *td = message_threads_mem + i;
+			int s;
+
+			for (s = 0; td->stage_threads && s < nr_stage_threads; s++)
+				trace_free(td->stage_threads + s);
+			trace_free(td);
+		}
+	}
+
+	res->wakeup = wakeup_stats;
+	res->request = request_stats;
+	res->requests = loop_count;
+	if (pipe_test)
+		res->rps = loops_per_sec;
+	else
+		res->rps = (double)loop_count / runtime;
+
+	pthread_mutex_lock(&stats_lock);
+	run_live = 0;
+	all_threads = NULL;
+	pthread_mutex_unlock(&stats_lock);
+	free_buffer(message_threads_mem, (message_threads * worker_threads +
+					  message_threads) *
+				       sizeof(struct thread_data));
+}
+
+/* everything between parsing the options and the first run */
+static void schbench_setup(int ac, char **av)
+{
+	int i;
+	int ret;
+
+	parse_options(ac, av);
+	if (work_plugin_spec)
+		work_plugin_load();
+
+	if (layout != LAYOUT_NONE || llc_stats || wake_pattern >= WAKE_REMOTE_LLC)
+		topology_init();
+	if (layout != LAYOUT_NONE)
+		layout_init();
+
+	if (worker_threads == 0) {
+		unsigned long num_cpus = get_nprocs();
+
+		worker_threads = (num_cpus + message_threads - 1) / message_threads;
+
+		fprintf(stderr, "setting worker threads to %d\n", worker_threads);
+	}
+
+	if (fanout >= worker_threads) {
+		if (worker_threads < 2) {
+			fprintf(stderr, "--fanout needs at least two worker threads\n");
+			setup_fail();
+		}
+		fanout = worker_threads - 1;
+		fprintf(stderr, "setting fanout to %d\n", fanout);
+	}
+
+	matrix_size = sqrt(cache_footprint_kb * 1024 / 3 / sizeof(unsigned long));
+
+	if (shared_lock_type != SHARED_LOCK_NONE)
+		shared_locks_init();
+
+	num_cpu_locks = get_nprocs();
+	per_cpu_locks = calloc(num_cpu_locks, sizeof(struct per_cpu_lock));
+	if (!per_cpu_locks) {
+		perror("unable to allocate memory for per cpu locks\n");
+		setup_fail();
+	}
+
+	for (i = 0; i < num_cpu_locks; i++) {
+		pthread_mutex_t *lock = &per_cpu_locks[i].lock;
+		ret = pthread_mutex_init(lock, NULL);
+		if (ret) {
+			perror("mutex init failed\n");
+			setup_fail();
+		}
+	}
+
+	if (trace_marker)
+		trace_open_marker();
+	if (cpuidle_stats)
+		cpuidle_init();
+	if (energy_stats)
+		energy_init();
+	if (cpu_dma_latency >= 0)
+		set_cpu_dma_latency();
+
+	requested_rps = requests_per_sec;
+}
+
+/*
+ * put every option back to its default, so the next schbench_create()
+ * starts from the same place the command line does
+ */
+static void reset_options(void)
+{
+	message_threads = 1;
+	message_threads_set = 0;
+	worker_threads = 0;
+	runtime = 30;
+	warmuptime = 0;
+	intervaltime = 10;
+	zerotime = 0;
+	tick_ms = 1000;
+	timeseries_file = NULL;
+	timeseries_len = 16384;
+	trace_file = NULL;
+	trace_entries = 65536;
+	trace_marker = 0;
+	trace_request_ids = 0;
+	perf_counters = 0;
+	cpuidle_stats = 0;
+	cpu_dma_latency = -1;
+	seed = 0;
+	seed_set = 0;
+	repeat_runs = 1;
+	repeat_cooldown = 5;
+	baseline_file = NULL;
+	save_baseline_file = NULL;
+	regress_alpha = 0.05;
+	regress_pct = 5.0;
+	layout = LAYOUT_NONE;
+	llc_stats = 0;
+	churn_pct = 0;
+	churn_ramp = 0;
+	churn_interval = 1000;
+	cpu_stats = 0;
+	energy_stats = 0;
+	auto_rps_exclude = 0;
+	mem_mode = MEM_MUNMAP;
+	buffer_mem = BUFFER_MALLOC;
+	wake_pattern = WAKE_LOCAL;
+	manifest_file = NULL;
+	requested_rps = 0;
+	cache_footprint_kb = 256;
+	operations = 5;
+	base_operations = 0;
+	auto_rps = 0;
+	auto_rps_target_hit = 0;
+	pipe_test = 0;
+	requests_per_sec = 0;
+	calibrate_only = 0;
+	skip_locking = 0;
+	work_steal = 0;
+	spin_usec = 0;
+	spin_adaptive = 0;
+	fanout = 0;
+	fanout_random = 0;
+	sleep_type = SLEEP_USLEEP;
+	shared_lock_type = SHARED_LOCK_NONE;
+	shared_lock_count = 1;
+	shared_lock_pct = 10;
+	shared_lock_read_pct = 80;
+	periodic_threads = 0;
+	periodic_period = 0;
+	memset(&periodic_sched, 0, sizeof(periodic_sched));
+	periodic_sched.policy = -1;
+	periodic_timer = PERIODIC_NANOSLEEP;
+	fibers = 0;
+
+	/* the option lists */
+	memset(stages, 0, sizeof(stages));
+	nr_stages = 1;
+	nr_request_phases = 0;
+	nr_mem_phases = 0;
+	nr_load_phases = 0;
+	memset(classes, 0, sizeof(classes));
+	nr_classes = 0;
+	free(pipeline_spec);
+	pipeline_spec = NULL;
+	free(request_template_spec);
+	request_template_spec = NULL;
+	free(schedule_spec);
+	schedule_spec = NULL;
+	free(work_plugin_spec);
+	work_plugin_spec = NULL;
+
+	/* and what setup worked out from them */
+	matrix_size = 0;
+	nr_energy_domains = 0;
+}
+
+/*
+ * undo schbench_setup().  This is also how a schbench_create() that
+ * failed partway cleans up, so everything here has to cope with setup
+ * never getting to it
+ */
+static void schbench_teardown(void)
+{
+	int i;
+
+	if (cpu_dma_latency_fd >= 0)
+		close(cpu_dma_latency_fd);
+	cpu_dma_latency_fd = -1;
+	if (trace_marker_fd >= 0)
+		close(trace_marker_fd);
+	trace_marker_fd = -1;
+	if (work_plugin && work_plugin->exit)
+		work_plugin->exit(work_plugin_data);
+	if (work_plugin_handle)
+		dlclose(work_plugin_handle);
+	work_plugin = NULL;
+	work_plugin_data = NULL;
+	work_plugin_handle = NULL;
+	free(per_cpu_locks);
+	per_cpu_locks = NULL;
+	num_cpu_locks = 0;
+	free(shared_locks);
+	shared_locks = NULL;
+
+	if (group_cpus) {
+		for (i = 0; i < message_threads; i++)
+			if (group_cpus[i])
+				CPU_FREE(group_cpus[i]);
+		free(group_cpus);
+		group_cpus = NULL;
+	}
+	free(cpu_topo);
+	cpu_topo = NULL;
+	free(llc_key);
+	llc_key = NULL;
+	topo_nr_cpus = 0;
+	nr_llcs = 0;
+
+	reset_options();
+}
+
+int schbench_main(int ac, char **av)
+{
+	int i;
+	struct run_result last_result;
+	struct repeat_values *repeat_results = NULL;
+	int regressed = 0;
+
+	schbench_setup(ac, av);
+
+	if (repeat_runs <= 1) {
+		run_once(&last_result);
+	} else {
+		repeat_results = calloc(repeat_runs, sizeof(*repeat_results));
+		if (!repeat_results) {
+			perror("unable to allocate repeat results");
+			exit(1);
+		}
+		for (i = 0; i < repeat_runs; i++) {
+			if (i && repeat_cooldown) {
+				fprintf(stderr, "cooling down for %d seconds\n",
+					repeat_cooldown);
+				sleep(repeat_cooldown);
+			}
+			fprintf(stderr, "run %d of %d\n", i + 1, repeat_runs);
+			run_once(&last_result);
+			repeat_result_values(&last_result, repeat_results + i);
+		}
+		show_repeat_summary(repeat_results, repeat_runs);
+	}
+
+	if (save_baseline_file) {
+		if (!repeat_results) {
+			repeat_results = calloc(1, sizeof(*repeat_results));
+			if (!repeat_results) {
+				perror("unable to allocate repeat results");
+				exit(1);
+			}
+			repeat_result_values(&last_result, repeat_results);
+		}
+		save_baseline(repeat_results, repeat_runs > 1 ? repeat_runs : 1);
+	}
+	if (baseline_file) {
+		if (!repeat_results) {
+			repeat_results = calloc(1, sizeof(*repeat_results));
+			if (!repeat_results) {
+				perror("unable to allocate repeat results");
+				exit(1);
+			}
+			repeat_result_values(&last_result, repeat_results);
+		}
+		regressed = compare_baseline(repeat_results,
+					     repeat_runs > 1 ? repeat_runs : 1);
+	}
+
+	if (manifest_file)
+		write_manifest(ac, av, &last_result.wakeup, &last_result.request,
+			       last_result.rps);
+
+	schbench_teardown();
+	free(repeat_results);
+	return regressed ? 2 : 0;
+}
+
+/*
+ * libschbench.  The context only holds the background run, everything
+ * else lives in the globals above, so there's only one of these at a
+ * time.  Destroying it puts the globals back the way they started
+ */
+struct schbench_ctx {
+	pthread_t tid;
+	int running;
+	struct run_result result;
+};
+
+static struct schbench_ctx *active_ctx = NULL;
+
+struct schbench_ctx *schbench_create(int ac, char **av)
+{
+	struct schbench_ctx *ctx;
+	jmp_buf env;
+
+	if (active_ctx)
+		return NULL;
+	if (setjmp(env)) {
+		/* setup_fail() already printed why */
+		setup_jmp = NULL;
+		schbench_teardown();
+		return NULL;
+	}
+	setup_jmp = &env;
+	/* 0 makes getopt forget everything from the last parse */
+	optind = 0;
+	schbench_setup(ac, av);
+	setup_jmp = NULL;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		schbench_teardown();
+		return NULL;
+	}
+	active_ctx = ctx;
+	return ctx;
+}
+
+static void *schbench_run_thread(void *arg)
+{
+	struct schbench_ctx *ctx = arg;
+
+	run_once(&ctx->result);
+	return NULL;
+}
+
+int schbench_start(struct schbench_ctx *ctx)
+{
+	int ret;
+
+	if (ctx->running)
+		return -EBUSY;
+	stop_requested = 0;
+	memset(&ctx->result, 0, sizeof(ctx->result));
+	ret = pthread_create(&ctx->tid, NULL, schbench_run_thread, ctx);
+	if (ret)
+		return -ret;
+	ctx->running = 1;
+	return 0;
+}
+
+int schbench_snapshot(struct schbench_ctx *ctx, struct schbench_snapshot *snap)
+{
+	memset(snap, 0, sizeof(*snap));
+	pthread_mutex_lock(&stats_lock);
+	if (run_live) {
+		__flip_thread_stats(all_threads, &snap_wakeup_stats,
+				    &snap_request_stats);
+		snap->wakeup = total_wakeup_stats;
+		snap->request = total_request_stats;
+		combine_message_thread_rps(all_threads, &snap->requests);
+	} else {
+		snap->wakeup = ctx->result.wakeup;
+		snap->request = ctx->result.request;
+		snap->requests = ctx->result.requests;
 	}
+	snap->rps = rps_stats;
+	pthread_mutex_unlock(&stats_lock);
+	return 0;
+}
 
+int schbench_stop(struct schbench_ctx *ctx, struct schbench_snapshot *snap)
+{
+	if (ctx->running) {
+		stop_requested = 1;
+		pthread_join(ctx->tid, NULL);
+		ctx->running = 0;
+	}
+	if (snap)
+		return schbench_snapshot(ctx, snap);
 	return 0;
 }
+
+void schbench_destroy(struct schbench_ctx *ctx)
+{
+	schbench_stop(ctx, NULL);
+	schbench_teardown();
+	free(ctx);
+	active_ctx = NULL;
+}
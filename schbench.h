@@ -0,0 +1,118 @@
+/*
+ * schbench.h
+ *
+ * Copyright (C) 2016 Facebook
+ * Chris Mason <clm@fb.com>
+ *
+ * GPLv2
+ *
+ * The interface to libschbench, for programs that want to drive
+ * schbench themselves, and the ABI for --work-plugin shared objects.
+ *
+ * The engine keeps its configuration and run state in process wide
+ * globals, so there can only be one context at a time.  It can be
+ * started and stopped as many times as you like, and destroying it
+ * puts everything back so the next one starts fresh.  Bad options and
+ * setup failures print an error and make schbench_create() return
+ * NULL.  Once a run is going, failures (out of memory, a thread that
+ * can't be created) still exit like the command line tool does.
+ */
+#ifndef SCHBENCH_H
+#define SCHBENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLAT_BITS	8
+#define PLAT_VAL	(1 << PLAT_BITS)
+#define PLAT_GROUP_NR	19
+#define PLAT_NR		(PLAT_GROUP_NR * PLAT_VAL)
+#define PLAT_LIST_MAX	20
+
+/*
+ * one stat struct per thread data, when the workers sleep this records the
+ * latency between when they are woken up and when they actually get the
+ * CPU again.  The message threads sum up the stats of all the workers and
+ * then bubble them up to main() for printing
+ */
+struct stats {
+	unsigned int plat[PLAT_NR];
+	unsigned long nr_samples;
+	unsigned int max;
+	unsigned int min;
+};
+
+/*
+ * what schbench_snapshot() hands back.  wakeup and request are in usecs,
+ * rps has one sample per tick.  requests is the number completed so far
+ */
+struct schbench_snapshot {
+	struct stats wakeup;
+	struct stats request;
+	struct stats rps;
+	unsigned long long requests;
+};
+
+struct schbench_ctx;
+
+/*
+ * parse argv exactly like the command line does (av[0] is skipped) and
+ * set everything up.  Returns NULL if the options are bad, setup
+ * fails, or another context exists
+ */
+struct schbench_ctx *schbench_create(int ac, char **av);
+
+/*
+ * kick off one run in the background, it stops by itself after -r
+ * seconds.  Returns -EBUSY if a run is already going
+ */
+int schbench_start(struct schbench_ctx *ctx);
+
+/*
+ * the histograms so far.  During a run this folds in everything the
+ * workers recorded up to now, afterwards it returns the final numbers.
+ * The samples it folds in still show up in the next --timeseries or
+ * --schedule tick
+ */
+int schbench_snapshot(struct schbench_ctx *ctx,
+		      struct schbench_snapshot *snap);
+
+/* end the run early if it's still going and wait for it, snap may be NULL */
+int schbench_stop(struct schbench_ctx *ctx, struct schbench_snapshot *snap);
+
+void schbench_destroy(struct schbench_ctx *ctx);
+
+/* the whole command line tool */
+int schbench_main(int ac, char **av);
+
+/*
+ * --work-plugin FILE[:ARG] loads FILE with dlopen and looks up a
+ * struct schbench_plugin named schbench_plugin.  Its do_work replaces
+ * the matrix math for every request, with the pipeline stages, fanout
+ * subtasks, request templates and shared locks all still around it.
+ *
+ * init gets ARG (or NULL) once per process, and whatever it returns is
+ * passed to thread_init, which runs in each thread before its first
+ * request.  If there's no thread_init, every thread gets init's return
+ * value.  ops is the number of operations schbench would have done
+ * (-n, or the stage/class/phase operations).  Everything but do_work
+ * is optional.
+ */
+#define SCHBENCH_PLUGIN_VERSION 1
+
+struct schbench_plugin {
+	int version;
+	const char *name;
+	void *(*init)(const char *arg);
+	void *(*thread_init)(void *plugin_data);
+	void (*do_work)(void *thread_data, unsigned long ops);
+	void (*thread_exit)(void *thread_data);
+	void (*exit)(void *plugin_data);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif